@@ -0,0 +1,32 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/* Static tracepoints (USDT) of the thread library, in the thread provider.
+ * They cost a nop instruction until a tracer attaches to them, e.g.:
+ *
+ *	bpftrace -e 'usdt:./test_wakeup:thread:switch { @[arg0, arg1] = count(); }'
+ *
+ * Without <sys/sdt.h> (systemtap-sdt-dev), or with -DNO_PROBES, they are
+ * compiled out.
+ *
+ * switch(Tid from, Tid to, int state)
+ *	the running thread from gives the cpu to to, and becomes state, e.g.,
+ *	READY or SLEEP
+ * sleep(Tid tid, struct wait_queue *queue)
+ *	tid is going to sleep in queue
+ * wakeup(Tid tid, struct wait_queue *queue)
+ *	tid was woken up from queue, and is ready to run */
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES
+#endif
+#endif
+
+#ifdef PROBES
+#define PROBE(name, ...) STAP_PROBEV(thread, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...) do { } while (0)
+#endif
+
+#endif /* _PROBES_H_ */
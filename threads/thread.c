@@ -5,6 +5,7 @@
 #include <string.h>
 #include "thread.h"
 #include "interrupt.h"
+#include "probes.h"
 
 
 
@@ -236,6 +237,7 @@ void thread_yield_to_id(Tid want_tid, thread_queue * queue, int STATE){
 			threadArray[thread_id()] = RUNNING;
 			runningThread->sid = RUNNING;
 		}
+		PROBE(switch, temp->tid, runningThread->tid, STATE);
 		setcontextCalled = true;
 		setcontext(runningThread->context);
 	}
@@ -423,6 +425,7 @@ thread_sleep(struct wait_queue *queue)
 		// int oldRunning = thread_id();///////////////// testing ////////////////
 		// thread_wakeup(waitQueueArray[thread_id()], 1);
 		Tid want_tid = readyQueue.head->tid;
+		PROBE(sleep, thread_id(), queue);
 		thread_yield_to_id(want_tid, queue, SLEEP);
 		// print_queue(readyQueue.head, "ready queue");
 		// printf("sleep: return SUCCESS on %d\n", oldRunning);///////////////// testing ////////////////
@@ -450,6 +453,7 @@ thread_wakeup(struct wait_queue *queue, int all)
 			count ++;
 			temp->sid = READY;
 			threadArray[temp->tid] = READY;
+			PROBE(wakeup, temp->tid, queue);
 			temp = temp->next;
 		}
 		insert_at_last(&readyQueue, queue->head);
@@ -462,6 +466,7 @@ thread_wakeup(struct wait_queue *queue, int all)
 		insert_at_last(&readyQueue, wakeupThread);
 		wakeupThread->sid = READY;
 		threadArray[wakeupThread->tid] = READY;
+		PROBE(wakeup, wakeupThread->tid, queue);
 		interrupts_set(oldEnable);
 		return 1;
 	}
@@ -0,0 +1,368 @@
+/*
+ * access_log.c: Logs requests without slowing down the threads serving them.
+ *
+ * A ring is a single producer, single consumer queue: the owner thread only
+ * writes head, and the log thread only writes tail, so each side publishes
+ * its index with a release store after touching the records. The owner keeps
+ * a stale copy of tail, and only reads the shared one when the ring looks
+ * half full, so that the two sides don't share a cache line on every request.
+ * A ring that stays half full after that wakes up the log thread early, once
+ * per drain, so that a burst doesn't have to wait for the next drain.
+ */
+
+#include <stddef.h>
+#include <sys/file.h>
+#include <time.h>
+#include "common.h"
+#include "access_log.h"
+
+#define ACCESS_RING_SIZE 4096	/* records per thread, a power of two */
+#define ACCESS_DRAIN_MS 50	/* the rings are drained at least this often */
+#define ACCESS_BATCH 256	/* records formatted per write */
+#define ACCESS_LINE_LEN 256	/* longer than any line of the text log */
+
+struct access_ring {
+	/* written by the owner thread */
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail_seen;	/* tail, as last read by the owner */
+	unsigned long woken_at;		/* tail_seen when the owner last woke
+					 * up the log thread */
+	unsigned long dropped;
+	/* written by the log thread */
+	unsigned long tail __attribute__((aligned(64)));
+	struct access_log *log;
+	struct access_ring *next;
+	struct access_record rec[ACCESS_RING_SIZE];
+};
+
+struct access_log {
+	pthread_mutex_t lock;	/* protects exiting, and adding rings */
+	pthread_cond_t wake;
+	pthread_t thread;
+	int exiting;
+	int text_fd;
+	int trace_fd;
+	struct access_ring *rings;
+	unsigned long written;	/* records written, by the log thread */
+	time_t date_sec;	/* the second that date was formatted for */
+	char date[32];
+	char text[ACCESS_BATCH * ACCESS_LINE_LEN];
+	struct access_record trace[ACCESS_BATCH];
+};
+
+_Static_assert(sizeof(struct access_record) == 128,
+	       "the trace record format has changed");
+
+static __thread struct access_ring *access_ring;
+
+uint64_t
+access_log_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t
+access_log_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* writes all of buf. errors are reported once, and then ignored, so that a
+ * full disk doesn't stop the server */
+static void
+access_log_output(int fd, const void *buf, size_t n)
+{
+	static int reported;
+	ssize_t ret;
+
+	while (n > 0) {
+		ret = write(fd, buf, n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (!reported++)
+				perror("access log");
+			return;
+		}
+		buf = (const char *)buf + ret;
+		n -= ret;
+	}
+}
+
+static const char *access_results[ACCESS_NR] = {
+	[ACCESS_NOCACHE] = "nocache",
+	[ACCESS_MISS] = "miss",
+	[ACCESS_HIT] = "hit",
+	[ACCESS_L1_HIT] = "l1",
+	[ACCESS_BLOCKS] = "blocks",
+	[ACCESS_ARCHIVE] = "archive",
+	[ACCESS_METRICS] = "metrics",
+};
+
+const char *
+access_result_name(int result)
+{
+	return result >= 0 && result < ACCESS_NR ? access_results[result] : "-";
+}
+
+/* appends the decimal digits of v to p, at least width of them. returns the
+ * end of the digits */
+static char *
+access_log_uint(char *p, unsigned long v, int width)
+{
+	char digits[20];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0 || n < width);
+	while (n > 0)
+		*p++ = digits[--n];
+	return p;
+}
+
+/* appends a time in ns as us, with one decimal */
+static char *
+access_log_us(char *p, uint32_t ns)
+{
+	*p++ = ' ';
+	p = access_log_uint(p, ns / 1000, 1);
+	*p++ = '.';
+	*p++ = '0' + ns % 1000 / 100;
+	return p;
+}
+
+/* formats rec as a line of the text log into buf. this is done by hand, as
+ * snprintf would take most of the time the log thread spends on a record.
+ * returns the length of the line. */
+static int
+access_log_format(struct access_log *log, char *buf,
+		  const struct access_record *rec)
+{
+	time_t sec = rec->time / 1000000000;
+	const char *result = access_result_name(rec->result);
+	char *p = buf;
+	size_t len;
+	struct tm tm;
+
+	if (sec != log->date_sec || log->date[0] == '\0') {
+		gmtime_r(&sec, &tm);
+		strftime(log->date, sizeof(log->date), "%Y-%m-%dT%H:%M:%S",
+			 &tm);
+		log->date_sec = sec;
+	}
+	len = strlen(log->date);
+	memcpy(p, log->date, len);
+	p += len;
+	*p++ = '.';
+	p = access_log_uint(p, rec->time % 1000000000 / 1000, 6);
+	*p++ = 'Z';
+	*p++ = ' ';
+	len = strnlen(rec->file, ACCESS_FILE_LEN);
+	memcpy(p, rec->file, len);
+	p += len;
+	*p++ = ' ';
+	p = access_log_uint(p, rec->status, 1);
+	*p++ = ' ';
+	p = access_log_uint(p, rec->length, 1);
+	*p++ = ' ';
+	len = strlen(result);
+	memcpy(p, result, len);
+	p += len;
+	p = access_log_us(p, rec->total_ns);
+	p = access_log_us(p, rec->parse_ns);
+	p = access_log_us(p, rec->read_ns);
+	p = access_log_us(p, rec->process_ns);
+	p = access_log_us(p, rec->send_ns);
+	*p++ = '\n';
+	return p - buf;
+}
+
+/* writes out the records in ring, in batches */
+static void
+access_log_drain_ring(struct access_log *log, struct access_ring *r)
+{
+	unsigned long tail = r->tail;
+	unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	int i, n, len;
+
+	while (tail != head) {
+		n = head - tail;
+		if (n > ACCESS_BATCH)
+			n = ACCESS_BATCH;
+		for (i = 0, len = 0; i < n; i++) {
+			log->trace[i] = r->rec[(tail + i) % ACCESS_RING_SIZE];
+			len += access_log_format(log, log->text + len,
+						 &log->trace[i]);
+		}
+		/* the records were copied, the owner can reuse their slots */
+		tail += n;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		access_log_output(log->text_fd, log->text, len);
+		access_log_output(log->trace_fd, log->trace,
+				  n * sizeof(struct access_record));
+		log->written += n;
+	}
+}
+
+static void
+access_log_drain(struct access_log *log)
+{
+	struct access_ring *r;
+
+	for (r = __atomic_load_n(&log->rings, __ATOMIC_ACQUIRE); r != NULL;
+	     r = r->next)
+		access_log_drain_ring(log, r);
+}
+
+static void *
+access_log_thread(void *arg)
+{
+	struct access_log *log = arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&log->lock);
+	while (!log->exiting) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += ACCESS_DRAIN_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&log->wake, &log->lock, &ts);
+		pthread_mutex_unlock(&log->lock);
+		access_log_drain(log);
+		pthread_mutex_lock(&log->lock);
+	}
+	pthread_mutex_unlock(&log->lock);
+	access_log_drain(log);
+	return NULL;
+}
+
+/* starts an empty trace with its header. the lock keeps other processes that
+ * open the same trace from writing a second header */
+static void
+access_log_trace_header(int fd)
+{
+	struct access_trace_header header;
+	struct stat st;
+
+	SYS(flock(fd, LOCK_EX));
+	SYS(fstat(fd, &st));
+	if (st.st_size == 0) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, ACCESS_TRACE_MAGIC, sizeof(header.magic));
+		header.version = ACCESS_TRACE_VERSION;
+		header.record_size = sizeof(struct access_record);
+		access_log_output(fd, &header, sizeof(header));
+	}
+	SYS(flock(fd, LOCK_UN));
+}
+
+struct access_log *
+access_log_create(const char *path)
+{
+	struct access_log *log;
+	char trace[MAXLINE];
+
+	log = Malloc(sizeof(struct access_log));
+	memset(log, 0, sizeof(struct access_log));
+	snprintf(trace, sizeof(trace), "%s.trace", path);
+	log->text_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	log->trace_fd = open(trace, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (log->text_fd < 0 || log->trace_fd < 0) {
+		if (log->text_fd >= 0)
+			close(log->text_fd);
+		free(log);
+		return NULL;
+	}
+	access_log_trace_header(log->trace_fd);
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->wake, NULL);
+	if ((errno = pthread_create(&log->thread, NULL, access_log_thread,
+				    log)))
+		unix_error("access_log_create: pthread_create");
+	return log;
+}
+
+void
+access_log_destroy(struct access_log *log)
+{
+	struct access_ring *r, *next;
+	unsigned long dropped = 0;
+
+	if (log == NULL)
+		return;
+	pthread_mutex_lock(&log->lock);
+	log->exiting = 1;
+	pthread_cond_signal(&log->wake);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->thread, NULL);
+
+	for (r = log->rings; r != NULL; r = next) {
+		next = r->next;
+		dropped += r->dropped;
+		if (access_ring == r)
+			access_ring = NULL;
+		free(r);
+	}
+	fprintf(stderr, "access log: %lu records, %lu dropped\n",
+		log->written, dropped);
+	SYS(close(log->text_fd));
+	SYS(close(log->trace_fd));
+	pthread_cond_destroy(&log->wake);
+	pthread_mutex_destroy(&log->lock);
+	free(log);
+}
+
+/* gives the calling thread a ring. rings stay on the list until the log is
+ * destroyed, so the log thread can walk it without taking the lock */
+static struct access_ring *
+access_log_register(struct access_log *log)
+{
+	struct access_ring *r = NULL;
+
+	if ((errno = posix_memalign((void **)&r, 64,
+				    sizeof(struct access_ring))))
+		unix_error("access_log_register: posix_memalign");
+	memset(r, 0, offsetof(struct access_ring, rec));
+	r->log = log;
+	pthread_mutex_lock(&log->lock);
+	r->next = log->rings;
+	__atomic_store_n(&log->rings, r, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&log->lock);
+	access_ring = r;
+	return r;
+}
+
+void
+access_log_write(struct access_log *log, const struct access_record *rec)
+{
+	struct access_ring *r = access_ring;
+	unsigned long head;
+
+	if (r == NULL || r->log != log)
+		r = access_log_register(log);
+	head = r->head;
+	if (head - r->tail_seen >= ACCESS_RING_SIZE / 2) {
+		r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head - r->tail_seen >= ACCESS_RING_SIZE) {
+			__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		if (head - r->tail_seen >= ACCESS_RING_SIZE / 2 &&
+		    r->woken_at != r->tail_seen) {
+			r->woken_at = r->tail_seen;
+			pthread_cond_signal(&log->wake);
+		}
+	}
+	r->rec[head % ACCESS_RING_SIZE] = *rec;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,76 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+#include <stdint.h>
+
+/* An access log that costs the serving threads a few stores per request.
+ *
+ * Every thread that calls access_log_write() gets its own ring of fixed size
+ * records, which only that thread writes and only the background thread of
+ * the log reads, so no locks are taken. The background thread drains the
+ * rings every few milliseconds, and appends the records to a text log, one
+ * line per request:
+ *
+ *   2026-10-18T09:30:01.123456Z /index.html 200 1234 hit 25.1 1.2 0.0 0.0 20.3
+ *
+ * with the time the request arrived, the file, status, body bytes sent, how
+ * the cache served it, and the total, parse, read, process and send times in
+ * microseconds. The same records are appended as they are to a binary trace,
+ * which starts with a struct access_trace_header. Records are dropped, and
+ * counted, when a ring is full. Both files are opened for appending, so that
+ * the worker processes of a prefork server can share them. */
+struct access_log;
+
+#define ACCESS_FILE_LEN 92	/* file name bytes kept, with the NUL */
+
+/* how a request was served */
+enum {
+	ACCESS_NOCACHE,		/* read from storage, without a cache */
+	ACCESS_MISS,		/* read from storage into the cache */
+	ACCESS_HIT,		/* sent from the cache */
+	ACCESS_L1_HIT,		/* sent from the thread's l1 cache */
+	ACCESS_BLOCKS,		/* sent from blocks of a large file */
+	ACCESS_ARCHIVE,		/* sent from the mapped archive */
+	ACCESS_METRICS,		/* the server's own metrics */
+	ACCESS_NR
+};
+
+/* the name of an ACCESS_* result, as in the text log */
+const char *access_result_name(int result);
+
+/* one request, 128 bytes, also the record format of the binary trace */
+struct access_record {
+	uint64_t time;		/* arrival, in ns since the Unix epoch */
+	uint32_t total_ns;	/* times, saturated at UINT32_MAX */
+	uint32_t parse_ns;
+	uint32_t read_ns;
+	uint32_t process_ns;
+	uint32_t send_ns;
+	uint32_t length;	/* body bytes sent */
+	uint16_t status;	/* HTTP status, 0 if nothing was sent */
+	uint8_t result;		/* ACCESS_* */
+	uint8_t pad;
+	char file[ACCESS_FILE_LEN]; /* truncated, NUL terminated */
+};
+
+#define ACCESS_TRACE_MAGIC "OSWTRACE"
+#define ACCESS_TRACE_VERSION 1
+
+struct access_trace_header {
+	char magic[8];		/* ACCESS_TRACE_MAGIC, without the NUL */
+	uint32_t version;	/* ACCESS_TRACE_VERSION */
+	uint32_t record_size;	/* sizeof(struct access_record) */
+};
+
+/* logs to path, and to path.trace. returns NULL if they can't be opened */
+struct access_log *access_log_create(const char *path);
+/* writes out the remaining records. no thread may log after this */
+void access_log_destroy(struct access_log *log);
+void access_log_write(struct access_log *log, const struct access_record *rec);
+
+/* times for the records: nanoseconds since an arbitrary point, for
+ * durations, and since the Unix epoch */
+uint64_t access_log_clock(void);
+uint64_t access_log_time(void);
+
+#endif /* __ACCESS_LOG_H__ */
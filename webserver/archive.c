@@ -0,0 +1,142 @@
+/*
+ * archive.c: Serves files out of a packed archive, mapped into memory.
+ *
+ * The whole archive is mapped once, with MAP_POPULATE, so that it is read
+ * into the page cache, and mapped, before the first request. A lookup is then
+ * a binary search of the index in the mapping, and a file is sent straight
+ * from its pages, without opening, reading or copying it. The index is checked
+ * when the archive is opened, so a lookup can trust its offsets.
+ */
+
+#include <stddef.h>
+#include <limits.h>
+#include "common.h"
+#include "fd_cache.h"
+#include "archive.h"
+
+struct archive {
+	const char *base;
+	size_t size;
+	const struct archive_header *header;
+	const struct archive_file *files;
+	const char *names;
+};
+
+/* checks that everything the header and the index point to is in the
+ * archive */
+static int
+archive_check(const struct archive *ar)
+{
+	const struct archive_header *h = ar->header;
+	const struct archive_file *f;
+	uint32_t i;
+
+	if (memcmp(h->magic, ARCHIVE_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != ARCHIVE_VERSION || h->size != ar->size)
+		return 0;
+	if (h->index % sizeof(uint64_t) != 0 || h->index > ar->size ||
+	    h->nr_files > (ar->size - h->index) / sizeof(struct archive_file))
+		return 0;
+	if (h->names > ar->size || h->names_size > ar->size - h->names ||
+	    (h->names_size > 0 && ar->base[h->names + h->names_size - 1] != 0))
+		return 0;
+	for (i = 0; i < h->nr_files; i++) {
+		f = &ar->files[i];
+		if (f->name >= h->names_size || f->body % ARCHIVE_ALIGN != 0 ||
+		    f->body > ar->size || f->size > ar->size - f->body ||
+		    f->size > INT_MAX)
+			return 0;
+		if (i > 0 && strcmp(ar->names + ar->files[i - 1].name,
+				    ar->names + f->name) >= 0)
+			return 0;	/* not sorted */
+	}
+	return 1;
+}
+
+struct archive *
+archive_open(const char *path)
+{
+	struct archive *ar;
+	struct stat st;
+	void *base;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < (off_t)sizeof(struct archive_header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+		    fd, 0);
+	close(fd);	/* the mapping keeps the file */
+	if (base == MAP_FAILED)
+		return NULL;
+	/* MAP_POPULATE is only a hint, the kernel may stop early */
+	madvise(base, st.st_size, MADV_WILLNEED);
+
+	ar = Malloc(sizeof(struct archive));
+	ar->base = base;
+	ar->size = st.st_size;
+	ar->header = base;
+	ar->files = (const struct archive_file *)(ar->base + ar->header->index);
+	ar->names = ar->base + ar->header->names;
+	if (!archive_check(ar)) {
+		archive_close(ar);
+		errno = EINVAL;
+		return NULL;
+	}
+	return ar;
+}
+
+void
+archive_close(struct archive *ar)
+{
+	if (ar == NULL)
+		return;
+	SYS(munmap((void *)ar->base, ar->size));
+	free(ar);
+}
+
+int
+archive_count(const struct archive *ar)
+{
+	return ar->header->nr_files;
+}
+
+const struct archive_file *
+archive_lookup(const struct archive *ar, const char *path)
+{
+	char name[MAXLINE];
+	int lo = 0, hi = (int)ar->header->nr_files - 1, mid, cmp;
+
+	fd_cache_normalize(path, name, sizeof(name));
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(name, ar->names + ar->files[mid].name);
+		if (cmp == 0)
+			return &ar->files[mid];
+		if (cmp < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+const char *
+archive_name(const struct archive *ar, const struct archive_file *file)
+{
+	return ar->names + file->name;
+}
+
+const char *
+archive_body(const struct archive *ar, const struct archive_file *file)
+{
+	return ar->base + file->body;
+}
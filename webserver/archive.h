@@ -0,0 +1,58 @@
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include <stdint.h>
+
+/* A read-only archive of a document root, packed by the pack tool, which the
+ * server maps into memory whole, so that files are served from the mapping
+ * without any system calls.
+ *
+ * An archive starts with a struct archive_header, followed by the index, an
+ * array of struct archive_file sorted by name, and then by the names. The
+ * contents of each file start on an ARCHIVE_ALIGN boundary, with their
+ * checksum in the index. Integers are stored in the byte order of the host
+ * that packed the archive. */
+struct archive;
+
+#define ARCHIVE_MAGIC "OSWPACK"	/* with the NUL, 8 bytes */
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_ALIGN 4096
+
+struct archive_header {
+	char magic[8];		/* ARCHIVE_MAGIC */
+	uint32_t version;	/* ARCHIVE_VERSION */
+	uint32_t nr_files;
+	uint64_t size;		/* bytes in the archive */
+	uint64_t index;		/* offset of the index */
+	uint64_t names;		/* offset of the names */
+	uint64_t names_size;	/* bytes of names, each NUL terminated */
+};
+
+struct archive_file {
+	uint64_t name;		/* offset of the normalized path, as in
+				 * fd_cache.h, from the start of the names */
+	uint64_t body;		/* offset of the contents, a multiple of
+				 * ARCHIVE_ALIGN */
+	uint64_t size;
+	int64_t mtime;
+	uint32_t csum;		/* csum_update() of the contents */
+	uint32_t pad;
+};
+
+/* maps the archive at path, and faults in all of it. returns NULL, with
+ * errno set, if it can't be mapped, or EINVAL if it isn't a valid archive.
+ * the archive file must not be changed while it is mapped, so pack writes a
+ * new archive next to the old one, and renames it over the old one. */
+struct archive *archive_open(const char *path);
+void archive_close(struct archive *ar);
+int archive_count(const struct archive *ar);
+
+/* looks up path, which need not be normalized. NULL if it isn't archived */
+const struct archive_file *archive_lookup(const struct archive *ar,
+					  const char *path);
+const char *archive_name(const struct archive *ar,
+			 const struct archive_file *file);
+const char *archive_body(const struct archive *ar,
+			 const struct archive_file *file);
+
+#endif /* __ARCHIVE_H__ */
@@ -0,0 +1,69 @@
+/*
+ * arena.c: Per-request bump allocator.
+ */
+
+#include "common.h"
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_SIZE 16384
+
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	/* aligned, so that the memory after the header is too */
+	char pad[ARENA_ALIGN - sizeof(struct arena_chunk *)];
+};
+
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	void *ptr;
+
+	size = ARENA_ROUND(size);
+	arena->nr_allocs++;
+	arena->peak += size;
+	if (arena->used + size <= arena->size) {
+		ptr = arena->base + arena->used;
+		arena->used += size;
+		return ptr;
+	}
+	chunk = Malloc(sizeof(struct arena_chunk) + size);
+	chunk->next = arena->overflow;
+	arena->overflow = chunk;
+	return chunk + 1;
+}
+
+void
+arena_reset(struct arena *arena)
+{
+	struct arena_chunk *chunk, *next;
+	size_t size;
+
+	for (chunk = arena->overflow; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->overflow = NULL;
+	if (arena->peak > arena->size) {
+		/* grow to fit everything in one piece the next time */
+		for (size = ARENA_MIN_SIZE; size < arena->peak; size *= 2)
+			;
+		free(arena->base);
+		arena->base = Malloc(size);
+		arena->size = size;
+	}
+	arena->used = 0;
+	arena->peak = 0;
+}
+
+void
+arena_destroy(struct arena *arena)
+{
+	arena_reset(arena);
+	free(arena->base);
+	arena->base = NULL;
+	arena->size = 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/* A bump allocator for state that lives as long as one request. Allocations
+ * are never freed one by one, the whole arena is emptied by arena_reset()
+ * instead. An arena starts out empty, so a zeroed struct arena is ready to
+ * use. Allocations that don't fit go to the heap until the next reset, which
+ * then grows the arena to the largest size seen, so that after a few requests
+ * the arena doesn't touch the heap anymore. */
+
+struct arena_chunk;
+
+struct arena {
+	char *base;
+	size_t size;
+	size_t used;
+	size_t peak;		/* bytes needed since the last reset */
+	struct arena_chunk *overflow;	/* allocations that didn't fit */
+	unsigned long nr_allocs;	/* total calls to arena_alloc() */
+};
+
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_reset(struct arena *arena);
+void arena_destroy(struct arena *arena);
+
+#endif /* __ARENA_H__ */
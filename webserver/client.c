@@ -1,9 +1,22 @@
 /*
  * client.c: A multi-threaded client for testing the HTTP server.
- * 
+ *
+ * By default, the client is closed-loop: each thread sends its next request
+ * when the previous one is done, so a slow server is sent fewer requests,
+ * and its latency looks better than it would be under the same load.
+ *
+ * With -r rps, the client is open-loop: nr_times * nr_threads requests are
+ * scheduled at rps per second, evenly spaced, or with -p, as a Poisson
+ * process. The threads take the scheduled requests in turn, and the latency
+ * of a request is measured from when it was scheduled to be sent, so that
+ * the time it waited for a free thread, because the server was slow, counts
+ * too. There must be enough threads for the requests that are in flight at
+ * once; requests that could not be sent on time are counted as late.
  */
 
 #include "common.h"
+#include "csum.h"
+#include "histogram.h"
 
 /* send an HTTP request for the specified file */
 static void
@@ -25,7 +38,7 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 {
 	struct rio *rio;
 	char buf[MAXBUF];
-	int i, n;
+	int n;
 	int length = 0;
 	int length_received = 0;
 	unsigned int csum = 0;
@@ -58,9 +71,7 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 			Rio_write(STDOUT_FILENO, buf, n);
 		}
 		length_received += n;
-		for (i = 0; i < n; i++) {
-			csum_received += (unsigned char)buf[i];
-		}
+		csum_received = csum_update(csum_received, buf, n);
 	} while (n > 0);
 
 	assert(orig_csum == csum);
@@ -85,40 +96,126 @@ struct client {
 	struct fileinfo *fileset;
 	int nr_files;
 	int timing_mode;
+	/* open-loop mode, when rate > 0 */
+	double rate;		/* requests per second */
+	int poisson;		/* exponential gaps, rather than 1 / rate */
+	pthread_mutex_t lock;	/* protects the schedule */
+	uint64_t next_send;	/* client_clock() time of the next request */
+	int nr_scheduled;
+	unsigned long nr_late;	/* sent more than CLIENT_LATE_NS late */
 };
 
-/* open a single connection to the specified host and port */
+#define CLIENT_LATE_NS 1000000
+
+static uint64_t
+client_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* open a single connection to the specified host and port, and request a
+ * random file of the file set */
+static void
+client_fetch(struct client *cl)
+{
+	int clientfd;
+	int fnr;
+
+	clientfd = open_clientfd(cl->host, cl->port);
+	/* get a random file from the file set */
+	fnr = rand_self_similar_int(0.2, cl->nr_files);
+	fnr--;
+	/* for debugging */
+	// fprintf(stderr, "requesting file: %s\n", 
+	// cl->fileset[fnr].name);
+	client_send(clientfd, cl->host, cl->fileset[fnr].name);
+	/* when timing_mode is 1, then don't print anything */
+	client_print(clientfd, cl->fileset[fnr].csum, 
+		     cl->fileset[fnr].len, (cl->timing_mode == 0));
+	SYS(close(clientfd));
+}
+
+/* takes the next request of the open-loop schedule, and sets send to the
+ * time it should be sent at. returns 0 when all requests have been taken */
+static int
+client_schedule(struct client *cl, uint64_t *send)
+{
+	double gap;
+
+	pthread_mutex_lock(&cl->lock);
+	if (cl->nr_scheduled == cl->nr_times * cl->nr_threads) {
+		pthread_mutex_unlock(&cl->lock);
+		return 0;
+	}
+	cl->nr_scheduled++;
+	*send = cl->next_send;
+	gap = 1e9 / cl->rate;
+	if (cl->poisson)	/* random() is below 2^31 */
+		gap *= -log(1 - random() / 2147483648.0);
+	cl->next_send += gap;
+	pthread_mutex_unlock(&cl->lock);
+	return 1;
+}
+
+/* sends requests as they are scheduled, until all have been sent */
+static void
+client_open_loop(struct client *cl, struct histogram *latency)
+{
+	struct timespec ts;
+	uint64_t send;
+
+	while (client_schedule(cl, &send)) {
+		ts.tv_sec = send / 1000000000;
+		ts.tv_nsec = send % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR)
+			;
+		if (client_clock() - send > CLIENT_LATE_NS)
+			__atomic_add_fetch(&cl->nr_late, 1, __ATOMIC_RELAXED);
+		client_fetch(cl);
+		/* from when the request should have been sent, as a user
+		 * of the server would have */
+		histogram_record(latency, client_clock() - send);
+	}
+}
+
+/* in timing mode, returns a histogram of the time each request took, from
+ * connecting, or from its scheduled time in open-loop mode, until the
+ * response is read. */
 static void *
 client_request(void *arg)
 {
 	struct client *cl = (struct client *)arg;
-	int clientfd;
+	struct histogram *latency = NULL;
+	uint64_t start = 0;
 	int i;
 
+	if (cl->timing_mode) {
+		latency = Malloc(sizeof(struct histogram));
+		memset(latency, 0, sizeof(struct histogram));
+	}
+	if (cl->rate > 0) {
+		client_open_loop(cl, latency);
+		return latency;
+	}
 	for (i = 0; i < cl->nr_times; i++) {
-		int fnr;
-
-		clientfd = open_clientfd(cl->host, cl->port);
-		/* get a random file from the file set */
-		fnr = rand_self_similar_int(0.2, cl->nr_files);
-		fnr--;
-		/* for debugging */
-		// fprintf(stderr, "requesting file: %s\n", 
-		// cl->fileset[fnr].name);
-		client_send(clientfd, cl->host, cl->fileset[fnr].name);
-		/* when timing_mode is 1, then don't print anything */
-		client_print(clientfd, cl->fileset[fnr].csum, 
-			     cl->fileset[fnr].len, (cl->timing_mode == 0));
-		SYS(close(clientfd));
+		if (latency)
+			start = client_clock();
+		client_fetch(cl);
+		if (latency)
+			histogram_record(latency, client_clock() - start);
 	}
-	return NULL;
+	return latency;
 }
 
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s [-t] host port nr_times nr_threads fileset\n",
-		program);
+	fprintf(stderr, "Usage: %s [-t] [-r rps [-p]] host port nr_times "
+		"nr_threads fileset\n", program);
 	exit(1);
 }
 
@@ -171,16 +268,28 @@ main(int argc, char *argv[])
 	pthread_t *threads;
 	struct client cl;
 	struct timeval start, end, diff;
+	struct histogram latency, *thread_latency;
 
-	if (argc != 6 && argc != 7) {
-		usage(argv[0]);
+	cl.timing_mode = 0;
+	cl.rate = 0;
+	cl.poisson = 0;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-t") == 0) {
+			cl.timing_mode = 1;
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			cl.rate = atof(argv[++i]);
+			if (cl.rate <= 0)
+				usage(argv[0]);
+			/* only the latencies are of interest */
+			cl.timing_mode = 1;
+		} else if (strcmp(argv[i], "-p") == 0) {
+			cl.poisson = 1;
+		} else {
+			usage(argv[0]);
+		}
 	}
-	i = 1;
-	if (strcmp(argv[i], "-t") == 0) {
-		cl.timing_mode = 1;
-		i++;
-	} else {
-		cl.timing_mode = 0;
+	if (argc - i != 5 || (cl.poisson && cl.rate == 0)) {
+		usage(argv[0]);
 	}
 	cl.host = argv[i++];
 	cl.port = atoi(argv[i++]);
@@ -198,14 +307,23 @@ main(int argc, char *argv[])
 		gettimeofday(&start, NULL);
 
 	init_random();
+	pthread_mutex_init(&cl.lock, NULL);
+	cl.next_send = client_clock();
+	cl.nr_scheduled = 0;
+	cl.nr_late = 0;
 
 	threads = Malloc(sizeof(pthread_t) * cl.nr_threads);
 	for (i = 0; i < cl.nr_threads; i++) {
 		SYS(pthread_create(&threads[i], NULL, client_request,
 				   (void *)&cl));
 	}
+	memset(&latency, 0, sizeof(latency));
 	for (i = 0; i < cl.nr_threads; i++) {
-		pthread_join(threads[i], NULL);
+		pthread_join(threads[i], (void **)&thread_latency);
+		if (thread_latency) {
+			histogram_merge(&latency, thread_latency);
+			free(thread_latency);
+		}
 	}
 
 	if (cl.timing_mode) {
@@ -213,6 +331,15 @@ main(int argc, char *argv[])
 		timersub(&end, &start, &diff);
 		printf("client runtime = %.6f seconds\n",
 			(float)diff.tv_sec + (float)diff.tv_usec / 1000000);
+		/* on stderr, as scripts read the run time from stdout */
+		histogram_print(stderr, "client latency", &latency);
+		if (cl.rate > 0) {
+			fprintf(stderr, "client open loop: %.1f requests/s "
+				"offered, %.1f served, %lu of %d sent late\n",
+				cl.rate, cl.nr_scheduled / ((double)diff.tv_sec +
+				diff.tv_usec / 1e6), cl.nr_late,
+				cl.nr_scheduled);
+		}
 	}
 	exit(0);
 }
@@ -13,10 +13,13 @@ unix_error(char *msg)
 /*********************************************
  * Wrappers for memory management functions
  ********************************************/
+__thread unsigned long nr_mallocs;
+
 void *
 Malloc(size_t size)
 {
 	void *rc;
+	nr_mallocs++;
 	rc = malloc(size);
 	if (!rc) {
 		unix_error("malloc");
@@ -31,6 +34,9 @@ Malloc(size_t size)
 /* Persistent state for the robust I/O (Rio) package */
 
 #define RIO_BUFSIZE 8192
+#define RIO_IOV_MAX 1024	/* max buffers per writev() call, IOV_MAX on linux */
+
+__thread unsigned long nr_writes;
 
 struct rio {
 	int rio_fd;	/* descriptor for this internal buf */
@@ -91,6 +97,7 @@ rio_write(int fd, void *usrbuf, size_t n)
 	char *bufp = usrbuf;
 
 	while (nleft > 0) {
+		nr_writes++;
 		if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 			if (errno == EINTR)	/* interrupted by sig handler return */
 				nwritten = 0;	/* and call write() again */
@@ -103,19 +110,85 @@ rio_write(int fd, void *usrbuf, size_t n)
 	return n;
 }
 
+/* rio_wait - waits until fd is ready for events, or until deadline, a
+ *    CLOCK_MONOTONIC time in ns. a deadline of 0 waits forever. returns 1 if
+ *    fd is ready, 0 if the deadline passed, and -1 on error. */
+static int
+rio_wait(int fd, short events, long long deadline)
+{
+	struct pollfd pfd = { fd, events };
+	struct timespec now;
+	long long left;
+	int ret, ms = -1;
+
+	while (1) {
+		if (deadline != 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left = deadline - (now.tv_sec * 1000000000LL +
+					   now.tv_nsec);
+			if (left <= 0)
+				return 0;
+			ms = (left + 999999) / 1000000;
+		}
+		ret = poll(&pfd, 1, ms);
+		if (ret > 0)	/* also on errors and hangups, which the next
+				 * read or write reports */
+			return 1;
+		if (ret < 0 && errno != EINTR)
+			return -1;
+	}
+}
+
+/* rio_writev - robustly write all the buffers in iov (unbuffered). after a
+ *    partial write, iov is updated to describe the bytes that are left. a
+ *    non-blocking fd is waited for until deadline (see rio_wait), after
+ *    which -1 is returned with errno set to ETIMEDOUT. */
+static ssize_t
+rio_writev(int fd, struct iovec *iov, int iovcnt, long long deadline)
+{
+	ssize_t n = 0, nwritten;
+	int ret;
+
+	while (iovcnt > 0) {
+		nr_writes++;
+		nwritten = writev(fd, iov,
+				  iovcnt < RIO_IOV_MAX ? iovcnt : RIO_IOV_MAX);
+		if (nwritten < 0) {
+			if (errno == EINTR)	/* interrupted by sig handler return */
+				continue;	/* and call writev() again */
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;	/* errno set by writev() */
+			/* the socket buffer is full */
+			if ((ret = rio_wait(fd, POLLOUT, deadline)) <= 0) {
+				if (ret == 0)
+					errno = ETIMEDOUT;
+				return -1;
+			}
+			continue;
+		}
+		n += nwritten;
+		/* skip the buffers that were written completely */
+		while (iovcnt > 0 && nwritten >= iov->iov_len) {
+			nwritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+	return n;
+}
+
 /* 
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * rio_fill - Refills the internal buffer via a call to read() if it is
+ *    empty. Returns the number of unread bytes in the internal buffer, 0 on
+ *    EOF, and -1 on error.
  */
 static ssize_t
-rio_readb(struct rio *rp, char *usrbuf, size_t n)
+rio_fill(struct rio *rp)
 {
-	int cnt;
-
 	while (rp->rio_cnt <= 0) {	/* refill if buf is empty */
 		rp->rio_cnt = read(rp->rio_fd, rp->rio_buf,
 				   sizeof(rp->rio_buf));
@@ -127,38 +200,36 @@ rio_readb(struct rio *rp, char *usrbuf, size_t n)
 		else
 			rp->rio_bufptr = rp->rio_buf;	/* reset buffer ptr */
 	}
-
-	/* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
-	cnt = n;
-	if (rp->rio_cnt < n)
-		cnt = rp->rio_cnt;
-	memcpy(usrbuf, rp->rio_bufptr, cnt);
-	rp->rio_bufptr += cnt;
-	rp->rio_cnt -= cnt;
-	return cnt;
+	return rp->rio_cnt;
 }
 
-/* rio_readlineb - robustly read a text line (buffered) */
+/* rio_readlineb - robustly read a text line (buffered). at most maxlen - 1
+ * bytes are read, so that the line can always be NUL terminated. the line
+ * end is found with memchr over the internal buffer, and the line is copied
+ * out with memcpy, rather than one byte at a time. */
 static ssize_t
 rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen)
 {
-	int n, rc;
-	char c, *bufp = usrbuf;
-
-	for (n = 0; n < maxlen; n++) {
-		if ((rc = rio_readb(rp, &c, 1)) == 1) {
-			*bufp++ = c;
-			if (c == '\n') {
-				n++;
-				break;
-			}
-		} else if (rc == 0) {
-			if (n == 0)
-				return 0;	/* EOF, no data read */
-			else
-				break;	/* EOF, some data was read */
-		} else
+	size_t n = 0, cnt;
+	ssize_t rc;
+	char *bufp = usrbuf, *eol = NULL;
+
+	while (n + 1 < maxlen && eol == NULL) {
+		if ((rc = rio_fill(rp)) < 0)
 			return -1;	/* error */
+		else if (rc == 0)
+			break;	/* EOF */
+		cnt = rp->rio_cnt;
+		if (cnt > maxlen - 1 - n)
+			cnt = maxlen - 1 - n;
+		eol = memchr(rp->rio_bufptr, '\n', cnt);
+		if (eol != NULL)
+			cnt = eol - rp->rio_bufptr + 1;
+		memcpy(bufp, rp->rio_bufptr, cnt);
+		rp->rio_bufptr += cnt;
+		rp->rio_cnt -= cnt;
+		bufp += cnt;
+		n += cnt;
 	}
 	*bufp = 0;
 	return n;
@@ -184,6 +255,34 @@ Rio_write(int fd, void *usrbuf, size_t n)
 		unix_error("Rio_writen error");
 }
 
+void
+Rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	if (rio_writev(fd, iov, iovcnt, 0) < 0)
+		unix_error("Rio_writev error");
+}
+
+int
+Rio_writev_until(int fd, struct iovec *iov, int iovcnt, long long deadline)
+{
+	if (rio_writev(fd, iov, iovcnt, deadline) < 0) {
+		if (errno == ETIMEDOUT || errno == EPIPE || errno == ECONNRESET)
+			return -1;	/* the connection is done for, not us */
+		unix_error("Rio_writev error");
+	}
+	return 0;
+}
+
+int
+Rio_wait(int fd, short events, long long deadline)
+{
+	int ret;
+
+	if ((ret = rio_wait(fd, events, deadline)) < 0)
+		unix_error("Rio_wait error");
+	return ret;
+}
+
 struct rio *
 Rio_init(int fd)
 {
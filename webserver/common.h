@@ -11,6 +11,7 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -62,8 +63,15 @@
 #define MAXBUF   8192	/* max I/O buffer size */
 #define LISTENQ  1024	/* second argument to listen() */
 
+/* Error handling */
+void unix_error(char *msg);
+
 /* Memory managment wrappers */
 void *Malloc(size_t size);
+/* number of Malloc() calls made by this thread */
+extern __thread unsigned long nr_mallocs;
+/* number of write system calls made by this thread's Rio_write(v) calls */
+extern __thread unsigned long nr_writes;
 
 /* Persistent state for the robust I/O (Rio) package */
 struct rio;
@@ -72,6 +80,15 @@ struct rio *Rio_init(int fd);
 void Rio_destroy(struct rio *rp);
 ssize_t Rio_read(int fd, void *usrbuf, size_t n);
 void Rio_write(int fd, void *usrbuf, size_t n);
+void Rio_writev(int fd, struct iovec *iov, int iovcnt);
+/* for non-blocking sockets: deadline is a CLOCK_MONOTONIC time in ns, or 0
+ * to wait as long as it takes. Rio_writev_until returns -1 with errno set if
+ * the deadline passed before all of iov was written (ETIMEDOUT), or if the
+ * peer has gone away (EPIPE or ECONNRESET, with SIGPIPE ignored), and 0
+ * otherwise. Rio_wait returns 0 if the deadline passed before fd became ready
+ * for events, 1 otherwise. */
+int Rio_writev_until(int fd, struct iovec *iov, int iovcnt, long long deadline);
+int Rio_wait(int fd, short events, long long deadline);
 ssize_t Rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen);
 
 /* Wrappers for client/server helper functions */
@@ -0,0 +1,119 @@
+/*
+ * csum.c: Computes the trivial byte sum checksum.
+ *
+ * The vector kernels use psadbw (sum of absolute differences against zero),
+ * which adds up groups of 8 bytes into 64-bit lanes without any risk of
+ * overflow, so the lanes only need to be added together at the end. The
+ * kernel is chosen when the checksum is first computed, based on what the
+ * cpu supports, so the code is built for the baseline instruction set.
+ */
+
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86
+#endif
+#include "csum.h"
+
+static unsigned int
+csum_scalar(unsigned int csum, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		csum += p[i];
+	return csum;
+}
+
+static int
+csum_always(void)
+{
+	return 1;
+}
+
+#ifdef CSUM_X86
+__attribute__((target("sse2"))) static unsigned int
+csum_sse2(unsigned int csum, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m128i zero = _mm_setzero_si128(), sum = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(p + i));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(chunk, zero));
+	}
+	csum += (unsigned int)_mm_cvtsi128_si32(sum) +
+		(unsigned int)_mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+	return csum_scalar(csum, p + i, len - i);
+}
+
+static int
+csum_sse2_supported(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("avx2"))) static unsigned int
+csum_avx2(unsigned int csum, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i sum0 = _mm256_setzero_si256(), sum1 = _mm256_setzero_si256();
+	__m128i sum;
+	size_t i;
+
+	/* two accumulators, so that the adds of one chunk don't wait for the
+	 * previous one */
+	for (i = 0; i + 64 <= len; i += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		sum0 = _mm256_add_epi64(sum0, _mm256_sad_epu8(a, zero));
+		sum1 = _mm256_add_epi64(sum1, _mm256_sad_epu8(b, zero));
+	}
+	sum0 = _mm256_add_epi64(sum0, sum1);
+	sum = _mm_add_epi64(_mm256_castsi256_si128(sum0),
+			    _mm256_extracti128_si256(sum0, 1));
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+	csum += (unsigned int)_mm_cvtsi128_si32(sum);
+	/* the sse2 kernel is not vex encoded, and mixing it with dirty upper
+	 * halves of the ymm registers is very slow */
+	_mm256_zeroupper();
+	return csum_sse2(csum, p + i, len - i);
+}
+
+static int
+csum_avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+const struct csum_kernel csum_kernels[] = {
+#ifdef CSUM_X86
+	{ "avx2", csum_avx2, csum_avx2_supported },
+	{ "sse2", csum_sse2, csum_sse2_supported },
+#endif
+	{ "scalar", csum_scalar, csum_always },
+	{ NULL, NULL, NULL },
+};
+
+static unsigned int (*csum_kernel)(unsigned int, const void *, size_t);
+
+unsigned int
+csum_update(unsigned int csum, const void *buf, size_t len)
+{
+	unsigned int (*update)(unsigned int, const void *, size_t);
+	const struct csum_kernel *k;
+
+	update = __atomic_load_n(&csum_kernel, __ATOMIC_RELAXED);
+	if (update == NULL) {
+		/* threads racing here all pick the same kernel */
+		for (k = csum_kernels; !k->supported(); k++)
+			;
+		update = k->update;
+		__atomic_store_n(&csum_kernel, update, __ATOMIC_RELAXED);
+	}
+	return update(csum, buf, len);
+}
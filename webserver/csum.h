@@ -0,0 +1,21 @@
+#ifndef __CSUM_H__
+#define __CSUM_H__
+
+#include <stddef.h>
+
+/* The trivial checksum sent in the Content-Csum header: the sum of all the
+ * bytes, modulo 2^32. csum_update() adds the bytes in buf to csum, so that a
+ * checksum can be computed piece by piece, starting from 0. */
+unsigned int csum_update(unsigned int csum, const void *buf, size_t len);
+
+/* the implementations of csum_update(), fastest first. csum_update() uses
+ * the first one that the cpu supports. */
+struct csum_kernel {
+	const char *name;
+	unsigned int (*update)(unsigned int csum, const void *buf, size_t len);
+	int (*supported)(void);
+};
+
+extern const struct csum_kernel csum_kernels[];	/* ends with a NULL name */
+
+#endif /* __CSUM_H__ */
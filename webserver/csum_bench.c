@@ -0,0 +1,65 @@
+/*
+ * csum_bench.c: Measures the throughput of the checksum kernels.
+ */
+
+#include "common.h"
+#include "csum.h"
+
+static double
+elapsed(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+		(end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct csum_kernel *k;
+	struct timeval start, end;
+	unsigned int expected, csum;
+	int size, iters, i;
+	char *buf;
+
+	if (argc > 3) {
+		fprintf(stderr, "Usage: %s [size] [iterations]\n", argv[0]);
+		exit(1);
+	}
+	size = argc > 1 ? atoi(argv[1]) : (1 << 20);
+	iters = argc > 2 ? atoi(argv[2]) : 1000;
+	if (size <= 0 || iters <= 0) {
+		fprintf(stderr, "arguments should be > 0\n");
+		exit(1);
+	}
+	if (size < 2) {	/* the odd offset check leaves out a byte at each end */
+		fprintf(stderr, "size should be at least 2\n");
+		exit(1);
+	}
+	buf = Malloc(size);
+	for (i = 0; i < size; i++)
+		buf[i] = random();
+	expected = 0;
+	for (i = 0; i < size; i++)
+		expected += (unsigned char)buf[i];
+
+	for (k = csum_kernels; k->name != NULL; k++) {
+		if (!k->supported()) {
+			printf("%-8s not supported\n", k->name);
+			continue;
+		}
+		/* an odd offset and length, to check the unaligned tails */
+		assert(k->update(0, buf + 1, size - 2) ==
+		       expected - (unsigned char)buf[0] -
+		       (unsigned char)buf[size - 1]);
+		csum = 0;
+		gettimeofday(&start, NULL);
+		for (i = 0; i < iters; i++)
+			csum += k->update(0, buf, size);
+		gettimeofday(&end, NULL);
+		assert(csum == expected * (unsigned int)iters);
+		printf("%-8s %8.2f GB/s\n", k->name,
+		       (double)size * iters / elapsed(&start, &end) / 1e9);
+	}
+	free(buf);
+	exit(0);
+}
@@ -0,0 +1,452 @@
+/*
+ * doc_index.c: An index of a static document root, with a minimal perfect
+ * hash on the file names.
+ *
+ * The hash is built with hash and displace: the names are first hashed into
+ * buckets of a few names each, and then the buckets, largest first, are each
+ * given the smallest displacement that sends all of their names to slots that
+ * are still free. A lookup hashes the name to find its bucket, and hashes it
+ * again with the displacement of the bucket to find its slot. The large
+ * buckets are placed while the table is mostly empty, and the last buckets
+ * hold one name each, so every bucket finds a displacement quickly.
+ */
+
+#include <dirent.h>
+#include <stdint.h>
+#include "common.h"
+#include "csum.h"
+#include "fd_cache.h"
+#include "doc_index.h"
+
+#define DOC_BUCKET_KEYS 4	/* average names per bucket */
+#define DOC_MAX_BUCKET 64	/* names in a bucket, before a new seed */
+#define DOC_MAX_TRIES (1 << 22)	/* displacements tried per bucket */
+#define DOC_MAX_SEEDS 16	/* hash seeds tried before giving up */
+#define DOC_MAX_DEPTH 32	/* directories scanned below the root */
+
+struct doc_index {
+	int nr_entries;		/* also the number of slots */
+	int nr_buckets;
+	uint64_t seed;
+	uint32_t *disp;		/* displacement of each bucket */
+	struct doc_entry *slots;
+};
+
+/* the entries found while building an index */
+struct doc_list {
+	struct doc_entry *entries;
+	int nr;
+	int max;
+};
+
+static uint64_t
+doc_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static uint64_t
+doc_hash(const char *name, uint64_t seed)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ doc_mix(seed);
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 0x100000001b3ULL;
+	}
+	return doc_mix(h);
+}
+
+static unsigned int
+doc_bucket(uint64_t h, int nr_buckets)
+{
+	return (h >> 32) % nr_buckets;
+}
+
+static unsigned int
+doc_slot(uint64_t h, uint32_t disp, int nr_slots)
+{
+	return doc_mix(h + disp * 0x9e3779b97f4a7c15ULL) % nr_slots;
+}
+
+const char *
+doc_mime_type(const char *name)
+{
+	if (strstr(name, ".html"))
+		return "text/html";
+	else if (strstr(name, ".gif"))
+		return "image/gif";
+	else if (strstr(name, ".jpg"))
+		return "image/jpeg";
+	return "text/plain";
+}
+
+static void
+doc_list_add(struct doc_list *list, const char *name, struct stat *st,
+	     unsigned int csum, int has_csum)
+{
+	struct doc_entry *e;
+
+	if (list->nr == list->max) {
+		list->max = list->max ? list->max * 2 : 256;
+		list->entries = realloc(list->entries,
+					sizeof(struct doc_entry) * list->max);
+		if (list->entries == NULL)
+			unix_error("doc_list_add: realloc");
+	}
+	e = &list->entries[list->nr++];
+	e->name = strdup(name);
+	e->size = st->st_size;
+	e->mtime = st->st_mtime;
+	e->csum = csum;
+	e->has_csum = has_csum;
+	e->type = doc_mime_type(name);
+}
+
+/* checksums a file the way request_readfile() does. returns 0 on failure */
+static int
+doc_csum_file(const char *path, unsigned int *csum)
+{
+	char buf[65536];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	*csum = 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		*csum = csum_update(*csum, buf, n);
+	close(fd);
+	return n == 0;
+}
+
+/* returns why a file may not be served, or NULL if it may be */
+char *
+doc_check_path(const char *name)
+{
+	const char *ext;
+
+	/* don't serve files that start with /, or .., or end in .c */
+	if (name[0] == '/') {
+		/* this shouldn't really happen because requests add a "./"
+		 * at the beginning of the file path */
+		return "OS Web Server doesn't serve files with absolute paths";
+	}
+	if (strstr(name, "..") != NULL) {
+		return "OS Web Server doesn't serve files with .. in the path";
+	}
+	if (((ext = strrchr(name, '.')) != NULL) &&
+	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
+		return "OS Web Server doesn't serve C or header files ";
+	}
+	return NULL;
+}
+
+int
+doc_servable(const char *name)
+{
+	return doc_check_path(name) == NULL;
+}
+
+/* the name that requests use for path: normalized, and relative to the
+ * working directory, which is the document root. returns -1 if an absolute
+ * path is outside of it */
+static int
+doc_name(const char *path, char *name, size_t max)
+{
+	char cwd[MAXLINE];
+	size_t n;
+
+	if (path[0] != '/') {
+		fd_cache_normalize(path, name, max);
+		return 0;
+	}
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		return -1;
+	n = strlen(cwd);
+	if (strncmp(path, cwd, n) != 0 ||
+	    (n > 1 && path[n] != '/' && path[n] != '\0'))
+		return -1;
+	fd_cache_normalize(path + n, name, max);
+	return 0;
+}
+
+/* adds the readable regular files below dir, like request_statfile() would
+ * find them */
+static int
+doc_scan(struct doc_list *list, const char *dir, int depth,
+	 int (*servable)(const char *name))
+{
+	char path[MAXLINE], name[MAXLINE];
+	struct dirent *de;
+	struct stat st;
+	unsigned int csum = 0;
+	int has_csum;
+	DIR *d;
+
+	if ((d = opendir(dir)) == NULL)
+		return -1;
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >=
+		    (int)sizeof(path) || stat(path, &st) < 0)
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			if (depth < DOC_MAX_DEPTH)
+				doc_scan(list, path, depth + 1, servable);
+			continue;
+		}
+		fd_cache_normalize(path, name, sizeof(name));
+		if (!S_ISREG(st.st_mode) || !(st.st_mode & S_IRUSR) ||
+		    !servable(name))
+			continue;
+		has_csum = doc_csum_file(path, &csum);
+		doc_list_add(list, name, &st, csum, has_csum);
+	}
+	closedir(d);
+	return 0;
+}
+
+/* returns 1 if file a was last modified no later than file b */
+static int
+doc_not_newer(const struct stat *a, const struct stat *b)
+{
+	if (a->st_mtim.tv_sec != b->st_mtim.tv_sec)
+		return a->st_mtim.tv_sec < b->st_mtim.tv_sec;
+	return a->st_mtim.tv_nsec <= b->st_mtim.tv_nsec;
+}
+
+/* adds the files listed in a fileset manifest: a line with the number of
+ * files, and then a "name checksum size" line for each file. a checksum is
+ * only trusted for the file it was made for: one of the same size, which
+ * hasn't been modified since the manifest was written. files outside the
+ * document root can't be requested, and are left out */
+static int
+doc_load_manifest(struct doc_list *list, const char *manifest,
+		  int (*servable)(const char *name))
+{
+	char line[MAXLINE], path[MAXLINE], name[MAXLINE];
+	unsigned int csum;
+	long long size;
+	struct stat st, mst;
+	FILE *f;
+
+	if ((f = fopen(manifest, "r")) == NULL)
+		return -1;
+	if (fstat(fileno(f), &mst) < 0) {
+		fclose(f);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "%8191s %u %lld", path, &csum, &size) != 3)
+			continue;	/* the count, or not a file */
+		if (doc_name(path, name, sizeof(name)) < 0 ||
+		    stat(path, &st) < 0 || !S_ISREG(st.st_mode) ||
+		    !(st.st_mode & S_IRUSR) || !servable(name))
+			continue;
+		doc_list_add(list, name, &st, csum, st.st_size == size &&
+			     doc_not_newer(&st, &mst));
+	}
+	fclose(f);
+	return 0;
+}
+
+static int
+doc_entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct doc_entry *)a)->name,
+		      ((const struct doc_entry *)b)->name);
+}
+
+/* returns 1 if slot is one of the first n in slots */
+static int
+doc_slot_in(const unsigned int *slots, int n, unsigned int slot)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (slots[i] == slot)
+			return 1;
+	}
+	return 0;
+}
+
+/* finds a displacement for every bucket. returns -1 if some bucket has none,
+ * e.g., because two of its names have the same hash. */
+static int
+doc_place(struct doc_index *index, struct doc_entry *entries, uint64_t *hash)
+{
+	int n = index->nr_entries, r = index->nr_buckets;
+	int *first, *next, *count, *order, i, j, k, b, ret = -1;
+	int start[DOC_MAX_BUCKET + 1];
+	unsigned int slot[DOC_MAX_BUCKET];
+	uint32_t d;
+	char *taken;
+
+	first = Malloc(sizeof(int) * r);
+	count = Malloc(sizeof(int) * r);
+	order = Malloc(sizeof(int) * r);
+	next = Malloc(sizeof(int) * (n > 0 ? n : 1));
+	taken = Malloc(n > 0 ? n : 1);
+	memset(taken, 0, n > 0 ? n : 1);
+	for (b = 0; b < r; b++) {
+		first[b] = -1;
+		count[b] = 0;
+		index->disp[b] = 0;	/* for names that aren't indexed */
+	}
+	for (i = 0; i < n; i++) {
+		b = doc_bucket(hash[i], r);
+		next[i] = first[b];
+		first[b] = i;
+		if (++count[b] > DOC_MAX_BUCKET)
+			goto out;
+	}
+	/* counting sort of the buckets, largest first */
+	memset(start, 0, sizeof(start));
+	for (b = 0; b < r; b++)
+		start[count[b]]++;
+	for (k = DOC_MAX_BUCKET, i = 0; k >= 0; k--) {
+		j = start[k];
+		start[k] = i;
+		i += j;
+	}
+	for (b = 0; b < r; b++)
+		order[start[count[b]]++] = b;
+
+	for (k = 0; k < r && count[order[k]] > 0; k++) {
+		b = order[k];
+		for (d = 0; d < DOC_MAX_TRIES; d++) {
+			for (i = first[b], j = 0; i >= 0; i = next[i], j++) {
+				slot[j] = doc_slot(hash[i], d, n);
+				if (taken[slot[j]] || doc_slot_in(slot, j, slot[j]))
+					break;
+			}
+			if (i < 0)	/* all the names fit */
+				break;
+		}
+		if (d == DOC_MAX_TRIES)
+			goto out;
+		index->disp[b] = d;
+		for (i = first[b], j = 0; i >= 0; i = next[i], j++) {
+			taken[slot[j]] = 1;
+			index->slots[slot[j]] = entries[i];
+		}
+	}
+	ret = 0;
+out:
+	free(first);
+	free(count);
+	free(order);
+	free(next);
+	free(taken);
+	return ret;
+}
+
+struct doc_index *
+doc_index_build(const char *source, int (*servable)(const char *name))
+{
+	struct doc_list list = { NULL, 0, 0 };
+	struct doc_index *index;
+	char dir[MAXLINE];
+	struct stat st;
+	uint64_t *hash;
+	int i, n, ret;
+
+	if (stat(source, &st) < 0)
+		return NULL;
+	if (S_ISDIR(st.st_mode)) {
+		/* the files are named as requests name them */
+		if (doc_name(source, dir, sizeof(dir)) < 0) {
+			fprintf(stderr, "%s: not below the document root, "
+				"the working directory\n", source);
+			errno = EINVAL;
+			return NULL;
+		}
+		ret = doc_scan(&list, dir, 0, servable);
+	} else
+		ret = doc_load_manifest(&list, source, servable);
+	if (ret < 0)
+		return NULL;
+
+	/* a manifest may list a file twice */
+	qsort(list.entries, list.nr, sizeof(struct doc_entry), doc_entry_cmp);
+	for (i = 0, n = 0; i < list.nr; i++) {
+		if (n > 0 && strcmp(list.entries[n - 1].name,
+				    list.entries[i].name) == 0)
+			free((char *)list.entries[i].name);
+		else
+			list.entries[n++] = list.entries[i];
+	}
+
+	index = Malloc(sizeof(struct doc_index));
+	index->nr_entries = n;
+	index->nr_buckets = n / DOC_BUCKET_KEYS + 1;
+	index->disp = Malloc(sizeof(uint32_t) * index->nr_buckets);
+	index->slots = Malloc(sizeof(struct doc_entry) * (n > 0 ? n : 1));
+	hash = Malloc(sizeof(uint64_t) * (n > 0 ? n : 1));
+	for (index->seed = 0; index->seed < DOC_MAX_SEEDS; index->seed++) {
+		for (i = 0; i < n; i++)
+			hash[i] = doc_hash(list.entries[i].name, index->seed);
+		if (doc_place(index, list.entries, hash) == 0)
+			break;
+	}
+	free(hash);
+	if (index->seed == DOC_MAX_SEEDS) {
+		index->nr_entries = 0;	/* the slots don't own the names */
+		for (i = 0; i < n; i++)
+			free((char *)list.entries[i].name);
+		doc_index_free(index);
+		index = NULL;
+		errno = EINVAL;
+	}
+	free(list.entries);
+	return index;
+}
+
+void
+doc_index_free(struct doc_index *index)
+{
+	int i;
+
+	if (index == NULL)
+		return;
+	for (i = 0; i < index->nr_entries; i++)
+		free((char *)index->slots[i].name);
+	free(index->slots);
+	free(index->disp);
+	free(index);
+}
+
+int
+doc_index_count(const struct doc_index *index)
+{
+	return index->nr_entries;
+}
+
+const struct doc_entry *
+doc_index_entry(const struct doc_index *index, int i)
+{
+	return &index->slots[i];
+}
+
+const struct doc_entry *
+doc_index_lookup(const struct doc_index *index, const char *path)
+{
+	const struct doc_entry *e;
+	char name[MAXLINE];
+	uint64_t h;
+
+	if (index->nr_entries == 0)
+		return NULL;
+	fd_cache_normalize(path, name, sizeof(name));
+	h = doc_hash(name, index->seed);
+	e = &index->slots[doc_slot(h, index->disp[doc_bucket(h,
+			index->nr_buckets)], index->nr_entries)];
+	return strcmp(e->name, name) == 0 ? e : NULL;
+}
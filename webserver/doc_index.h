@@ -0,0 +1,54 @@
+#ifndef __DOC_INDEX_H__
+#define __DOC_INDEX_H__
+
+#include <sys/types.h>
+#include <time.h>
+
+/* An immutable index of the files in a static document root, so that a
+ * request can be checked, and its file described, without any system calls
+ * or string checks on the path.
+ *
+ * The index is built from a directory, which is scanned recursively, or from
+ * the .idx manifest written by fileset. File names are looked up with a
+ * minimal perfect hash: every name in the index has a slot of its own in a
+ * table of exactly as many slots as there are names, and a lookup hashes the
+ * name twice and compares it with the one name in its slot.
+ *
+ * An index is never changed after it is built. To pick up changes to the
+ * document root, build a new one and replace the old one. */
+struct doc_index;
+
+struct doc_entry {
+	const char *name;	/* normalized path, as in fd_cache.h, and
+				 * where the file is read from */
+	off_t size;
+	time_t mtime;
+	unsigned int csum;	/* csum_update() of the contents, */
+	int has_csum;		/* if this is set */
+	const char *type;	/* MIME type */
+};
+
+/* files for which servable() returns 0 are left out. names are relative to
+ * the working directory, the document root, so a source directory, even
+ * one given by an absolute path, must be below it. returns NULL, with errno
+ * set, if source can't be read. */
+struct doc_index *doc_index_build(const char *source,
+				  int (*servable)(const char *name));
+void doc_index_free(struct doc_index *index);
+int doc_index_count(const struct doc_index *index);
+/* entry i, for i < doc_index_count(), in no particular order */
+const struct doc_entry *doc_index_entry(const struct doc_index *index, int i);
+
+/* looks up path, which need not be normalized. NULL if it isn't indexed */
+const struct doc_entry *doc_index_lookup(const struct doc_index *index,
+					 const char *path);
+
+/* returns why the file name may not be served, or NULL if it may be. the
+ * server and pack only index the files that doc_servable() accepts */
+char *doc_check_path(const char *name);
+int doc_servable(const char *name);
+
+/* the MIME type served for a file name */
+const char *doc_mime_type(const char *name);
+
+#endif /* __DOC_INDEX_H__ */
@@ -0,0 +1,153 @@
+/*
+ * epoch.c: Epoch-based reclamation for lock-free readers.
+ *
+ * There is a global epoch, and every reader publishes the epoch it saw when
+ * it entered. An object retired in epoch e can only be reached by readers
+ * that entered in epoch e or earlier, so it is freed once the global epoch
+ * reaches e + 2. The global epoch only advances when every active reader has
+ * seen the current epoch, so three lists of retired objects are enough.
+ */
+
+#include "common.h"
+#include "epoch.h"
+
+#define EPOCH_LISTS 3
+
+struct epoch_thread {
+	unsigned long epoch;	/* global epoch when this thread entered */
+	int active;		/* 1 while between epoch_enter and epoch_exit */
+	int in_use;		/* 0 after the thread has exited */
+	struct epoch_thread *next;
+};
+
+struct epoch_garbage {
+	void *ptr;
+	void (*free_fn)(void *);
+	struct epoch_garbage *next;
+};
+
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long global_epoch;
+static struct epoch_thread *epoch_threads;
+static struct epoch_garbage *limbo[EPOCH_LISTS];
+static __thread struct epoch_thread *self;
+
+static void
+epoch_register(void)
+{
+	struct epoch_thread *t;
+
+	pthread_mutex_lock(&epoch_lock);
+	for (t = epoch_threads; t != NULL; t = t->next) {
+		if (!t->in_use)
+			break;
+	}
+	if (t == NULL) {
+		t = Malloc(sizeof(struct epoch_thread));
+		t->next = epoch_threads;
+		epoch_threads = t;
+	}
+	t->active = 0;
+	t->in_use = 1;
+	self = t;
+	pthread_mutex_unlock(&epoch_lock);
+}
+
+static void
+epoch_free_list(struct epoch_garbage *g)
+{
+	struct epoch_garbage *next;
+
+	for (; g != NULL; g = next) {
+		next = g->next;
+		g->free_fn(g->ptr);
+		free(g);
+	}
+}
+
+void
+epoch_enter(void)
+{
+	if (self == NULL)
+		epoch_register();
+	__atomic_store_n(&self->active, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->epoch,
+			 __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE),
+			 __ATOMIC_RELAXED);
+	/* the epoch must be visible before we read any shared pointers */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+epoch_exit(void)
+{
+	__atomic_store_n(&self->active, 0, __ATOMIC_RELEASE);
+}
+
+/* advances the global epoch if all active readers have seen it, and returns
+ * the objects that became safe to free. called with epoch_lock held. */
+static struct epoch_garbage *
+epoch_try_advance(void)
+{
+	struct epoch_thread *t;
+	struct epoch_garbage *g;
+	unsigned long epoch = global_epoch;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (t = epoch_threads; t != NULL; t = t->next) {
+		if (__atomic_load_n(&t->active, __ATOMIC_ACQUIRE) &&
+		    __atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE) != epoch)
+			return NULL;
+	}
+	epoch++;
+	__atomic_store_n(&global_epoch, epoch, __ATOMIC_RELEASE);
+	/* retired in epoch - 2 */
+	g = limbo[(epoch + 1) % EPOCH_LISTS];
+	limbo[(epoch + 1) % EPOCH_LISTS] = NULL;
+	return g;
+}
+
+void
+epoch_retire(void *ptr, void (*free_fn)(void *))
+{
+	struct epoch_garbage *g = Malloc(sizeof(struct epoch_garbage));
+	unsigned long epoch;
+
+	g->ptr = ptr;
+	g->free_fn = free_fn;
+	pthread_mutex_lock(&epoch_lock);
+	epoch = global_epoch;
+	g->next = limbo[epoch % EPOCH_LISTS];
+	limbo[epoch % EPOCH_LISTS] = g;
+	g = epoch_try_advance();
+	pthread_mutex_unlock(&epoch_lock);
+	epoch_free_list(g);
+}
+
+void
+epoch_thread_exit(void)
+{
+	if (self == NULL)
+		return;
+	pthread_mutex_lock(&epoch_lock);
+	self->active = 0;
+	self->in_use = 0;
+	pthread_mutex_unlock(&epoch_lock);
+	self = NULL;
+}
+
+void
+epoch_drain(void)
+{
+	struct epoch_garbage *g[EPOCH_LISTS];
+	int i;
+
+	pthread_mutex_lock(&epoch_lock);
+	for (i = 0; i < EPOCH_LISTS; i++) {
+		g[i] = limbo[i];
+		limbo[i] = NULL;
+	}
+	pthread_mutex_unlock(&epoch_lock);
+	for (i = 0; i < EPOCH_LISTS; i++)
+		epoch_free_list(g[i]);
+}
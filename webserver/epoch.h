@@ -0,0 +1,19 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+/* Epoch-based reclamation. Readers bracket their accesses to a shared
+ * structure with epoch_enter() and epoch_exit(), without taking any locks.
+ * Writers unlink objects from the structure and pass them to epoch_retire(),
+ * which frees them once every reader that could still see them has left its
+ * epoch. */
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/* called by a thread that will not enter an epoch again */
+void epoch_thread_exit(void);
+/* frees everything that is retired, when there are no readers left */
+void epoch_drain(void);
+
+#endif /* __EPOCH_H__ */
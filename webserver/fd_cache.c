@@ -0,0 +1,269 @@
+/*
+ * fd_cache.c: A cache of open file descriptors.
+ *
+ * The entries are kept in a hash table and an lru list, both protected by
+ * one mutex. The lock is only held to find or insert an entry, and never
+ * across a system call other than close().
+ */
+
+#include "common.h"
+#include "fd_cache.h"
+
+#define FD_TABLE_SIZE 521
+
+struct fd_entry {
+	int fd;
+	int refs;		/* requests using fd */
+	int evicted;		/* closed when the last reference is dropped */
+	struct fd_entry *hnext;	/* hash chain */
+	struct fd_entry *lru_prev;	/* towards the most recently used entry */
+	struct fd_entry *lru_next;
+	char path[];
+};
+
+struct fd_cache {
+	pthread_mutex_t lock;
+	int root;		/* document root directory */
+	int max_fds;
+	int nr_fds;		/* entries in the table */
+	struct fd_entry *lru_head;
+	struct fd_entry *lru_tail;
+	struct fd_entry *table[FD_TABLE_SIZE];
+};
+
+static unsigned int
+fd_hash(const char *path)
+{
+	unsigned int hash = 5381;
+
+	while (*path)
+		hash = hash * 33 + (unsigned char)*path++;
+	return hash % FD_TABLE_SIZE;
+}
+
+void
+fd_cache_normalize(const char *path, char *out, size_t max)
+{
+	const char *p = path, *end;
+	size_t len = 0, n;
+
+	while (*p) {
+		for (end = p; *end && *end != '/'; end++)
+			;
+		n = end - p;
+		if (n > 0 && !(n == 1 && p[0] == '.') && len + n + 2 <= max) {
+			if (len > 0)
+				out[len++] = '/';
+			memcpy(out + len, p, n);
+			len += n;
+		}
+		p = *end ? end + 1 : end;
+	}
+	if (len == 0)
+		out[len++] = '.';
+	out[len] = 0;
+}
+
+static void
+fd_lru_unlink(struct fd_cache *cache, struct fd_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+static void
+fd_lru_push(struct fd_cache *cache, struct fd_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+}
+
+static struct fd_entry *
+fd_search(struct fd_cache *cache, const char *path)
+{
+	struct fd_entry *entry;
+
+	for (entry = cache->table[fd_hash(path)]; entry != NULL;
+	     entry = entry->hnext) {
+		if (strcmp(entry->path, path) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/* removes an entry from the cache. it is freed now, or by the last
+ * fd_cache_put() if it is in use. called with the lock held. */
+static void
+fd_remove(struct fd_cache *cache, struct fd_entry *entry)
+{
+	struct fd_entry **prevp;
+
+	for (prevp = &cache->table[fd_hash(entry->path)]; *prevp != entry;
+	     prevp = &(*prevp)->hnext)
+		;
+	*prevp = entry->hnext;
+	fd_lru_unlink(cache, entry);
+	cache->nr_fds--;
+	entry->evicted = 1;
+	if (entry->refs == 0) {
+		close(entry->fd);
+		free(entry);
+	}
+}
+
+struct fd_cache *
+fd_cache_create(const char *root, int max_fds)
+{
+	struct fd_cache *cache;
+
+	cache = Malloc(sizeof(struct fd_cache));
+	memset(cache, 0, sizeof(struct fd_cache));
+	pthread_mutex_init(&cache->lock, NULL);
+	SYS(cache->root = open(root, O_RDONLY | O_DIRECTORY));
+	cache->max_fds = max_fds;
+	return cache;
+}
+
+/* all references must have been dropped */
+void
+fd_cache_destroy(struct fd_cache *cache)
+{
+	if (cache == NULL)
+		return;
+	while (cache->lru_tail != NULL) {
+		assert(cache->lru_tail->refs == 0);
+		fd_remove(cache, cache->lru_tail);
+	}
+	SYS(close(cache->root));
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+/* opens name, relative to dirfd, if it is a regular file. the open doesn't
+ * block, so that a fifo or a device in the document root can't wedge the
+ * thread before its type is known. fails with ENOENT for anything else, as it
+ * is not a file the server serves. */
+static int
+fd_open(int dirfd, const char *name)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		errno = ENOENT;
+		return -1;
+	}
+	return fd;
+}
+
+int
+fd_cache_get(struct fd_cache *cache, const char *path, struct fd_ref *ref)
+{
+	char name[MAXLINE];
+	struct fd_entry *entry, *raced;
+	size_t len;
+	int fd, retried = 0;
+
+retry:
+	ref->entry = NULL;
+	if (cache == NULL || cache->max_fds == 0) {
+		if ((ref->fd = fd_open(AT_FDCWD, path)) < 0)
+			return -1;
+		goto out;
+	}
+	fd_cache_normalize(path, name, sizeof(name));
+	pthread_mutex_lock(&cache->lock);
+	entry = fd_search(cache, name);
+	if (entry != NULL) {
+		entry->refs++;
+		fd_lru_unlink(cache, entry);
+		fd_lru_push(cache, entry);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (entry == NULL) {
+		if ((fd = fd_open(cache->root, name)) < 0)
+			return -1;
+		len = strlen(name) + 1;
+		entry = Malloc(sizeof(struct fd_entry) + len);
+		entry->fd = fd;
+		entry->refs = 1;
+		entry->evicted = 0;
+		memcpy(entry->path, name, len);
+		pthread_mutex_lock(&cache->lock);
+		raced = fd_search(cache, name);
+		if (raced != NULL) {
+			/* another request opened it first, use that one */
+			raced->refs++;
+			pthread_mutex_unlock(&cache->lock);
+			close(fd);
+			free(entry);
+			entry = raced;
+		} else {
+			while (cache->nr_fds >= cache->max_fds)
+				fd_remove(cache, cache->lru_tail);
+			entry->hnext = cache->table[fd_hash(name)];
+			cache->table[fd_hash(name)] = entry;
+			fd_lru_push(cache, entry);
+			cache->nr_fds++;
+			pthread_mutex_unlock(&cache->lock);
+		}
+	}
+	ref->fd = entry->fd;
+	ref->entry = entry;
+out:
+	/* an open descriptor still sees changes to the file, so this keeps the
+	 * size and modification time up to date without a path walk */
+	if (fstat(ref->fd, &ref->st) < 0) {
+		int err = errno;
+		fd_cache_put(cache, ref);
+		errno = err;
+		return -1;
+	}
+	if (ref->st.st_nlink == 0 && ref->entry != NULL && !retried) {
+		/* the file was removed or replaced, look up its path again */
+		pthread_mutex_lock(&cache->lock);
+		if (!((struct fd_entry *)ref->entry)->evicted)
+			fd_remove(cache, ref->entry);
+		pthread_mutex_unlock(&cache->lock);
+		fd_cache_put(cache, ref);
+		retried = 1;
+		goto retry;
+	}
+	return 0;
+}
+
+void
+fd_cache_put(struct fd_cache *cache, struct fd_ref *ref)
+{
+	struct fd_entry *entry = ref->entry;
+
+	if (entry == NULL) {
+		if (ref->fd >= 0)
+			close(ref->fd);
+		ref->fd = -1;
+		return;
+	}
+	pthread_mutex_lock(&cache->lock);
+	if (--entry->refs == 0 && entry->evicted) {
+		close(entry->fd);
+		free(entry);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	ref->entry = NULL;
+	ref->fd = -1;
+}
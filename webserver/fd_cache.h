@@ -0,0 +1,37 @@
+#ifndef __FD_CACHE_H__
+#define __FD_CACHE_H__
+
+#include <sys/stat.h>
+
+/* A cache of open file descriptors, so that repeated requests for a file
+ * don't walk its path and open and close it every time. Files are opened
+ * with openat() relative to a descriptor for the document root, and are
+ * keyed by their normalized path. At most max_fds files are kept open, and
+ * the least recently used one is closed to make room for another.
+ *
+ * A NULL cache is valid, and opens and closes the file on every use. */
+struct fd_cache;
+
+struct fd_ref {
+	int fd;
+	struct stat st;		/* fstat() of fd, refreshed by every get */
+	void *entry;		/* private to the cache */
+};
+
+struct fd_cache *fd_cache_create(const char *root, int max_fds);
+void fd_cache_destroy(struct fd_cache *cache);
+
+/* opens path, relative to the document root, and fills in ref. only regular
+ * files are opened, anything else fails with ENOENT. the
+ * descriptor stays valid until ref is passed to fd_cache_put(), even if the
+ * file is evicted in the meantime. returns 0 on success, and -1 with errno
+ * set on failure. */
+int fd_cache_get(struct fd_cache *cache, const char *path, struct fd_ref *ref);
+void fd_cache_put(struct fd_cache *cache, struct fd_ref *ref);
+
+/* the key of path in the cache: removes empty and "." components, so that
+ * "./a//b/./c" becomes "a/b/c". ".." components are left alone, and should
+ * have been rejected before. */
+void fd_cache_normalize(const char *path, char *out, size_t max);
+
+#endif /* __FD_CACHE_H__ */
@@ -0,0 +1,126 @@
+/*
+ * histogram.c: Log-linear latency histograms.
+ *
+ * Values below 2^HISTOGRAM_SUB_BITS have a bucket each. Above that, a value
+ * with its top bit at e goes to the buckets of the power of two 2^e, and the
+ * HISTOGRAM_SUB_BITS bits below its top bit pick one of them. Finding a
+ * bucket is a count of leading zeros and a shift.
+ */
+
+#include "histogram.h"
+
+static unsigned int
+histogram_bucket(uint64_t value)
+{
+	unsigned int e;
+
+	if (value < (1 << HISTOGRAM_SUB_BITS))
+		return value;
+	if (value >> HISTOGRAM_MAX_BITS)
+		return HISTOGRAM_BUCKETS - 1;
+	e = 63 - __builtin_clzll(value);
+	return (e - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS |
+		((value >> (e - HISTOGRAM_SUB_BITS)) &
+		 ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/* the largest value that goes to bucket b */
+static uint64_t
+histogram_bucket_max(unsigned int b)
+{
+	unsigned int shift;
+	uint64_t low;
+
+	if (b < (1 << HISTOGRAM_SUB_BITS))
+		return b;
+	shift = (b >> HISTOGRAM_SUB_BITS) - 1;
+	low = (uint64_t)((b & ((1 << HISTOGRAM_SUB_BITS) - 1)) |
+			 (1 << HISTOGRAM_SUB_BITS)) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+/* only the owner writes h, so a load and a store is enough, but they are
+ * atomic so that readers don't see torn counts */
+#define HISTOGRAM_ADD(field, n) \
+	__atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+void
+histogram_record(struct histogram *h, uint64_t value)
+{
+	HISTOGRAM_ADD(h->buckets[histogram_bucket(value)], 1);
+	HISTOGRAM_ADD(h->count, 1);
+	HISTOGRAM_ADD(h->sum, value);
+	if (value > h->max)
+		__atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+void
+histogram_merge(struct histogram *to, const struct histogram *from)
+{
+	uint64_t max;
+	int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		to->buckets[i] += __atomic_load_n(&from->buckets[i],
+						  __ATOMIC_RELAXED);
+	to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+	if (max > to->max)
+		to->max = max;
+}
+
+uint64_t
+histogram_percentile(const struct histogram *h, double percentile)
+{
+	uint64_t total = 0, seen = 0, target, max;
+	int i;
+
+	/* the counts of the buckets, rather than h->count, which a concurrent
+	 * writer may not have updated yet */
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		total += h->buckets[i];
+	if (total == 0)
+		return 0;
+	target = (uint64_t)(percentile / 100 * total + 0.5);
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			break;
+	}
+	if (i >= HISTOGRAM_BUCKETS - 1)	/* also holds the values too large
+					 * for a bucket */
+		return h->max;
+	max = histogram_bucket_max(i);
+	return max < h->max ? max : h->max;
+}
+
+uint64_t
+histogram_count_below(const struct histogram *h, uint64_t limit)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+		if (histogram_bucket_max(i) > limit)
+			break;
+		count += h->buckets[i];
+	}
+	return count;
+}
+
+void
+histogram_print(FILE *f, const char *name, const struct histogram *h)
+{
+	fprintf(f, "%s: %lu requests, mean %.1f, p50 %.1f, p90 %.1f, "
+		"p99 %.1f, p99.9 %.1f, max %.1f us\n", name,
+		(unsigned long)h->count,
+		h->count ? (double)h->sum / h->count / 1000 : 0.0,
+		histogram_percentile(h, 50) / 1000.0,
+		histogram_percentile(h, 90) / 1000.0,
+		histogram_percentile(h, 99) / 1000.0,
+		histogram_percentile(h, 99.9) / 1000.0,
+		h->max / 1000.0);
+}
@@ -0,0 +1,42 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* A latency histogram with log-linear buckets, as in HdrHistogram: every power
+ * of two is split into 2^HISTOGRAM_SUB_BITS buckets of equal width, so any
+ * value is reported within 1% of what was recorded, from a nanosecond up to
+ * 2^HISTOGRAM_MAX_BITS ns (about 18 minutes). Larger values are counted in
+ * the last bucket, but max is kept exactly.
+ *
+ * A histogram is written by one thread only, without locks, and may be read,
+ * e.g., by histogram_merge(), by other threads at the same time. A reader
+ * sees each count as it was at some point, but not all of them at once. */
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS \
+	((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/* a histogram must start out zeroed */
+void histogram_record(struct histogram *h, uint64_t value);
+/* adds the counts of from to those of to, which the caller owns */
+void histogram_merge(struct histogram *to, const struct histogram *from);
+/* the value below which percentile % of the values are, e.g., 99.9. 0 for
+ * an empty histogram */
+uint64_t histogram_percentile(const struct histogram *h, double percentile);
+/* the number of values at most limit, counting only the buckets that lie
+ * wholly below it */
+uint64_t histogram_count_below(const struct histogram *h, uint64_t limit);
+/* prints a line with the count, mean, p50, p90, p99, p99.9 and max, taking
+ * the values to be ns, and printing them in us */
+void histogram_print(FILE *f, const char *name, const struct histogram *h);
+
+#endif /* __HISTOGRAM_H__ */
@@ -0,0 +1,125 @@
+/*
+ * http_parse.c: Parses HTTP request headers in place.
+ *
+ * Line ends, spaces and colons are found 16 (SSE2) or 32 (AVX2) bytes at a
+ * time by comparing a whole vector against the byte we are looking for and
+ * taking the first set bit of the resulting mask. The vector code is chosen
+ * at compile time, so build with -mavx2 (or -march=native) to get AVX2.
+ */
+
+#include <string.h>
+#include <strings.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "http_parse.h"
+
+/* returns a pointer to the first c in [p, end), or end if there is none */
+static const char *
+http_find(const char *p, const char *end, char c)
+{
+#if defined(__AVX2__)
+	__m256i needle32 = _mm256_set1_epi8(c);
+
+	while (end - p >= 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+		unsigned int mask = _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(chunk, needle32));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i needle16 = _mm_set1_epi8(c);
+
+	while (end - p >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)p);
+		unsigned int mask = _mm_movemask_epi8(
+			_mm_cmpeq_epi8(chunk, needle16));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	while (p < end && *p != c)
+		p++;
+	return p;
+}
+
+static int
+http_is_space(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/* sets s to [p, end) with the surrounding white space removed */
+static void
+http_trim(struct http_slice *s, const char *p, const char *end)
+{
+	while (p < end && http_is_space(*p))
+		p++;
+	while (end > p && http_is_space(end[-1]))
+		end--;
+	s->p = p;
+	s->len = end - p;
+}
+
+/* splits off the next space separated token of the request line */
+static const char *
+http_token(struct http_slice *s, const char *p, const char *end)
+{
+	const char *sp = http_find(p, end, ' ');
+
+	s->p = p;
+	s->len = sp - p;
+	while (sp < end && *sp == ' ')
+		sp++;
+	return sp;
+}
+
+int
+http_parse_request(const char *buf, int len, struct http_request *req)
+{
+	const char *p = buf, *end = buf + len, *eol, *line_end, *colon;
+	struct http_header *h;
+
+	req->nr_headers = 0;
+	/* the request line: method, uri and version */
+	eol = http_find(p, end, '\n');
+	if (eol == end)
+		return 0;
+	line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+	p = http_token(&req->method, p, line_end);
+	p = http_token(&req->uri, p, line_end);
+	p = http_token(&req->version, p, line_end);
+	if (req->method.len == 0 || req->uri.len == 0 || p != line_end ||
+	    (req->version.len > 0 && strncmp(req->version.p, "HTTP/", 5) != 0))
+		return -1;
+
+	/* the headers, up to an empty line */
+	for (p = eol + 1; ; p = eol + 1) {
+		eol = http_find(p, end, '\n');
+		if (eol == end)
+			return 0;
+		line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+		if (line_end == p)
+			return eol + 1 - buf;
+		colon = http_find(p, line_end, ':');
+		if (colon == line_end || colon == p)
+			return -1;
+		if (req->nr_headers == HTTP_MAX_HEADERS)
+			continue;
+		h = &req->headers[req->nr_headers++];
+		h->name.p = p;
+		h->name.len = colon - p;
+		http_trim(&h->value, colon + 1, line_end);
+	}
+}
+
+int
+http_slice_equals(const struct http_slice *s, const char *str)
+{
+	return strlen(str) == (size_t)s->len &&
+	       strncasecmp(s->p, str, s->len) == 0;
+}
@@ -0,0 +1,36 @@
+#ifndef __HTTP_PARSE_H__
+#define __HTTP_PARSE_H__
+
+/* A zero-copy HTTP request parser. The parser works in place on the buffer
+ * that the request was read into, and returns slices that point into that
+ * buffer, so the buffer must outlive the parsed request. */
+
+#define HTTP_MAX_HEADERS 32
+
+struct http_slice {
+	const char *p;
+	int len;
+};
+
+struct http_header {
+	struct http_slice name;
+	struct http_slice value; /* without surrounding white space */
+};
+
+struct http_request {
+	struct http_slice method;
+	struct http_slice uri;
+	struct http_slice version;
+	struct http_header headers[HTTP_MAX_HEADERS]; /* extra ones are skipped */
+	int nr_headers;
+};
+
+/* parses the request line and headers in buf[0..len). returns the length of
+ * the request, including the empty line that ends it, 0 if the request is
+ * incomplete, and -1 if it is malformed. */
+int http_parse_request(const char *buf, int len, struct http_request *req);
+
+/* case insensitive comparison of a slice with a string */
+int http_slice_equals(const struct http_slice *s, const char *str);
+
+#endif /* __HTTP_PARSE_H__ */
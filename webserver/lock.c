@@ -0,0 +1,112 @@
+/*
+ * lock.c: Mutexes that profile themselves, with -DLOCK_STATS.
+ *
+ * A lock is first tried without blocking, so that the time stamp counter is
+ * only read before the wait when there is one. Everything but the wait is
+ * updated while the lock is held, by one thread at a time. The stores are
+ * atomic only so that lock_print() can read them while the lock is in use.
+ *
+ * pthread_cond_wait() takes the lock back without telling whether it had to
+ * wait for it. A waiter that was signaled, and finds that the lock was
+ * released after the signal, was held up by the threads that had it in
+ * between, from the signal until it got the lock.
+ */
+
+#ifdef LOCK_STATS
+#include <errno.h>
+#include <string.h>
+#include "stage_timer.h"
+#include "lock.h"
+
+#define LOCK_ADD(field, n) \
+	__atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+void
+lock_acquire(struct lock *l)
+{
+	uint64_t start;
+
+	if (pthread_mutex_trylock(&l->mutex) == EBUSY) {
+		start = stage_clock();
+		pthread_mutex_lock(&l->mutex);
+		l->locked_at = stage_clock();
+		LOCK_ADD(l->wait_ticks, l->locked_at - start);
+		LOCK_ADD(l->contended, 1);
+	} else {
+		l->locked_at = stage_clock();
+	}
+	LOCK_ADD(l->acquired, 1);
+}
+
+void
+lock_release(struct lock *l)
+{
+	l->released_at = stage_clock();
+	histogram_record(&l->held, stage_ns(l->released_at - l->locked_at));
+	pthread_mutex_unlock(&l->mutex);
+}
+
+void
+lock_wait(pthread_cond_t *cond, struct lock *l)
+{
+	uint64_t start;
+
+	start = l->released_at = stage_clock();
+	histogram_record(&l->held, stage_ns(start - l->locked_at));
+	pthread_cond_wait(cond, &l->mutex);
+	l->locked_at = stage_clock();
+	/* the wait for the signal itself is not contention, and neither is a
+	 * wakeup without a signal */
+	if (l->signaled_at > start && l->released_at > l->signaled_at) {
+		LOCK_ADD(l->wait_ticks, l->locked_at - l->signaled_at);
+		LOCK_ADD(l->contended, 1);
+	}
+	LOCK_ADD(l->acquired, 1);
+}
+
+void
+lock_signal(pthread_cond_t *cond, struct lock *l)
+{
+	l->signaled_at = stage_clock();
+	pthread_cond_signal(cond);
+}
+
+void
+lock_broadcast(pthread_cond_t *cond, struct lock *l)
+{
+	l->signaled_at = stage_clock();
+	pthread_cond_broadcast(cond);
+}
+
+int
+lock_get_stats(struct lock *l, struct lock_stats *stats)
+{
+	stats->acquired = __atomic_load_n(&l->acquired, __ATOMIC_RELAXED);
+	stats->contended = __atomic_load_n(&l->contended, __ATOMIC_RELAXED);
+	stats->wait_ns = stage_ns(__atomic_load_n(&l->wait_ticks,
+						  __ATOMIC_RELAXED));
+	return 1;
+}
+
+void
+lock_print(FILE *f, struct lock *l)
+{
+	struct histogram held;
+	struct lock_stats stats;
+
+	lock_get_stats(l, &stats);
+	if (stats.acquired == 0)
+		return;
+	fprintf(f, "lock %s: %lu acquired, %lu contended (%.1f%%), "
+		"%.2f ms waiting, %.2f us per contended acquisition\n",
+		l->name, stats.acquired, stats.contended,
+		100.0 * stats.contended / stats.acquired, stats.wait_ns / 1e6,
+		stats.contended ? stats.wait_ns / 1e3 / stats.contended : 0.0);
+	memset(&held, 0, sizeof(held));
+	histogram_merge(&held, &l->held);
+	fprintf(f, "lock %s held: p50 %.2f, p99 %.2f, p99.9 %.2f, max %.2f us\n",
+		l->name, histogram_percentile(&held, 50) / 1e3,
+		histogram_percentile(&held, 99) / 1e3,
+		histogram_percentile(&held, 99.9) / 1e3, held.max / 1e3);
+}
+#endif /* LOCK_STATS */
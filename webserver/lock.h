@@ -0,0 +1,109 @@
+#ifndef __LOCK_H__
+#define __LOCK_H__
+
+#include <pthread.h>
+#include <stdio.h>
+
+/* A mutex that, when built with -DLOCK_STATS, profiles itself: it counts the
+ * times it is taken, and the times a thread had to wait for it, and records
+ * the total wait and a histogram of how long it was held. Without
+ * LOCK_STATS, the functions are the pthread ones, and lock_print() prints
+ * nothing.
+ *
+ * The statistics are updated by the thread that holds the lock, so they cost
+ * no extra atomic operations, only two reads of the time stamp counter per
+ * acquisition, and a third when the lock was contended.
+ *
+ * A thread that waits on a condition with lock_wait() takes the lock again
+ * once it is woken up, which is an acquisition too, and a contended one if
+ * it had to wait for another thread to release the lock first. To tell,
+ * conditions waited on with lock_wait() must be signaled with lock_signal()
+ * or lock_broadcast(), while holding the lock. */
+
+/* what a lock has recorded, for reporting it elsewhere */
+struct lock_stats {
+	unsigned long acquired;
+	unsigned long contended;
+	double wait_ns;
+};
+
+#ifdef LOCK_STATS
+#include <stdint.h>
+#include "histogram.h"
+
+struct lock {
+	pthread_mutex_t mutex;
+	const char *name;
+	uint64_t acquired;
+	uint64_t contended;	/* acquisitions that had to wait */
+	uint64_t wait_ticks;	/* stage_clock() ticks spent waiting */
+	uint64_t locked_at;	/* when the holder took the lock */
+	uint64_t released_at;	/* when a holder last released it */
+	uint64_t signaled_at;	/* when a holder last woke up waiters */
+	struct histogram held;	/* ns from taking the lock to releasing it */
+};
+
+#define LOCK_INITIALIZER(name) { PTHREAD_MUTEX_INITIALIZER, (name) }
+
+void lock_acquire(struct lock *l);
+void lock_release(struct lock *l);
+/* pthread_cond_wait(), which doesn't count the wait as holding the lock,
+ * and counts getting the lock back after the signal as an acquisition */
+void lock_wait(pthread_cond_t *cond, struct lock *l);
+/* pthread_cond_signal() and pthread_cond_broadcast(), called with l held */
+void lock_signal(pthread_cond_t *cond, struct lock *l);
+void lock_broadcast(pthread_cond_t *cond, struct lock *l);
+/* prints the statistics of the lock, if it was taken at all */
+void lock_print(FILE *f, struct lock *l);
+/* returns 0 if the statistics are compiled out */
+int lock_get_stats(struct lock *l, struct lock_stats *stats);
+#else
+struct lock {
+	pthread_mutex_t mutex;
+};
+
+#define LOCK_INITIALIZER(name) { PTHREAD_MUTEX_INITIALIZER }
+
+static inline void
+lock_acquire(struct lock *l)
+{
+	pthread_mutex_lock(&l->mutex);
+}
+
+static inline void
+lock_release(struct lock *l)
+{
+	pthread_mutex_unlock(&l->mutex);
+}
+
+static inline void
+lock_wait(pthread_cond_t *cond, struct lock *l)
+{
+	pthread_cond_wait(cond, &l->mutex);
+}
+
+static inline void
+lock_signal(pthread_cond_t *cond, struct lock *l)
+{
+	pthread_cond_signal(cond);
+}
+
+static inline void
+lock_broadcast(pthread_cond_t *cond, struct lock *l)
+{
+	pthread_cond_broadcast(cond);
+}
+
+static inline void
+lock_print(FILE *f, struct lock *l)
+{
+}
+
+static inline int
+lock_get_stats(struct lock *l, struct lock_stats *stats)
+{
+	return 0;
+}
+#endif /* LOCK_STATS */
+
+#endif /* __LOCK_H__ */
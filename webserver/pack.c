@@ -0,0 +1,185 @@
+#include <limits.h>
+#include <stdint.h>
+#include <popt.h>
+#include "common.h"
+#include "csum.h"
+#include "doc_index.h"
+#include "archive.h"
+
+/* Pack the files of a document root into an archive that the server can map
+ * and serve from (see archive.h) */
+
+poptContext context;	/* context for parsing command-line options */
+
+/* the directory, or fileset manifest, with the files to pack */
+#define DEFAULT_SOURCE fileset_dir
+/* the archive that is created */
+#define DEFAULT_ARCHIVE fileset_dir.pack
+
+static char *output = STR(DEFAULT_ARCHIVE);
+
+static void
+usage()
+{
+	poptPrintUsage(context, stderr, 0);
+	exit(1);
+}
+
+static int
+pack_entry_cmp(const void *a, const void *b)
+{
+	return strcmp((*(const struct doc_entry **)a)->name,
+		      (*(const struct doc_entry **)b)->name);
+}
+
+static uint64_t
+pack_align(uint64_t offset, uint64_t align)
+{
+	return (offset + align - 1) / align * align;
+}
+
+/* writes all of buf at offset in fd */
+static void
+pack_write(int fd, const void *buf, size_t n, uint64_t offset)
+{
+	ssize_t ret;
+
+	while (n > 0) {
+		SYS(ret = pwrite(fd, buf, n, offset));
+		buf = (const char *)buf + ret;
+		n -= ret;
+		offset += ret;
+	}
+}
+
+/* copies size bytes of the file name to offset in fd. returns their
+ * checksum */
+static unsigned int
+pack_copy(int fd, const char *name, uint64_t size, uint64_t offset)
+{
+	char buf[65536];
+	unsigned int csum = 0;
+	uint64_t done = 0;
+	ssize_t n;
+	int src;
+
+	SYS(src = open(name, O_RDONLY));
+	while (done < size) {
+		n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+		SYS(n = read(src, buf, n));
+		if (n == 0) {
+			fprintf(stderr, "%s: file shrank while packing\n",
+				name);
+			exit(1);
+		}
+		csum = csum_update(csum, buf, n);
+		pack_write(fd, buf, n, offset + done);
+		done += n;
+	}
+	SYS(close(src));
+	return csum;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct archive_header header;
+	struct archive_file *files;
+	const struct doc_entry **entries;
+	struct doc_index *index;
+	const char *source = STR(DEFAULT_SOURCE);
+	char tmp[MAXLINE], *names;
+	uint64_t names_size = 0, offset;
+	int i, n, nr_files = 0, fd;
+	char c;
+
+	struct poptOption options_table[] = {
+		{NULL, 'o', POPT_ARG_STRING, &output, 'o',
+		 "archive to create",
+		 " default: " STR(DEFAULT_ARCHIVE)},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
+
+	context = poptGetContext(NULL, argc, argv, options_table, 0);
+	poptSetOtherOptionHelp(context, "[OPTIONS] [directory or manifest]");
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	if (poptPeekArg(context) != NULL)
+		source = poptGetArg(context);
+	if (poptPeekArg(context) != NULL)
+		usage();
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", output) >= (int)sizeof(tmp)) {
+		fprintf(stderr, "archive name is too long\n");
+		usage();
+	}
+
+	if ((index = doc_index_build(source, doc_servable)) == NULL) {
+		fprintf(stderr, "%s: %s\n", source, strerror(errno));
+		exit(1);
+	}
+	/* the archive is sorted by name, so that it can be searched */
+	n = doc_index_count(index);
+	entries = Malloc(sizeof(struct doc_entry *) * (n > 0 ? n : 1));
+	for (i = 0; i < n; i++) {
+		if (doc_index_entry(index, i)->size > INT_MAX) {
+			fprintf(stderr, "%s: too large, skipped\n",
+				doc_index_entry(index, i)->name);
+			continue;
+		}
+		entries[nr_files++] = doc_index_entry(index, i);
+		names_size += strlen(doc_index_entry(index, i)->name) + 1;
+	}
+	qsort(entries, nr_files, sizeof(struct doc_entry *), pack_entry_cmp);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+	header.version = ARCHIVE_VERSION;
+	header.nr_files = nr_files;
+	header.index = sizeof(header);
+	header.names = header.index +
+		(uint64_t)nr_files * sizeof(struct archive_file);
+	header.names_size = names_size;
+	files = Malloc(sizeof(struct archive_file) * (nr_files > 0 ? nr_files : 1));
+	names = Malloc(names_size > 0 ? names_size : 1);
+
+	/* a new archive is written next to the old one, which a server may
+	 * have mapped, and replaces it when it is complete */
+	SYS(fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+	offset = pack_align(header.names + names_size, ARCHIVE_ALIGN);
+	names_size = 0;
+	for (i = 0; i < nr_files; i++) {
+		files[i].name = names_size;
+		files[i].body = offset;
+		files[i].size = entries[i]->size;
+		files[i].mtime = entries[i]->mtime;
+		files[i].pad = 0;
+		strcpy(names + names_size, entries[i]->name);
+		names_size += strlen(entries[i]->name) + 1;
+		files[i].csum = pack_copy(fd, entries[i]->name,
+					  files[i].size, offset);
+		offset = pack_align(offset + files[i].size, ARCHIVE_ALIGN);
+	}
+	header.size = offset;
+	pack_write(fd, names, names_size, header.names);
+	pack_write(fd, files, sizeof(struct archive_file) * nr_files,
+		   header.index);
+	pack_write(fd, &header, sizeof(header), 0);
+	SYS(ftruncate(fd, header.size));	/* pads the last file */
+	SYS(fsync(fd));
+	SYS(close(fd));
+	SYS(rename(tmp, output));
+	printf("%s: %d files, %llu bytes\n", output, nr_files,
+	       (unsigned long long)header.size);
+
+	free(names);
+	free(files);
+	free(entries);
+	doc_index_free(index);
+	poptFreeContext(context);
+	return 0;
+}
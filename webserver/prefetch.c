@@ -0,0 +1,369 @@
+/*
+ * prefetch.c: Prefetches the files that are likely to be requested next.
+ *
+ * The successor table is direct mapped by a hash of the file name, so it
+ * uses a fixed amount of memory, and a file that maps to a taken slot simply
+ * replaces the file that was there. Each slot keeps the few most frequent
+ * successors of its file, with counts that are halved when one saturates, so
+ * that the table follows changes in the access pattern.
+ *
+ * Worker threads don't touch the table. Each one records its requests into a
+ * ring of its own, which it fills and the background thread drains, without
+ * a lock, so recording costs a cache hit a copy of the file name and a
+ * sem_post(). A thread's requests are counted as successors of its own
+ * previous request, not of whatever another thread served last. The
+ * background thread owns the table and the queue, and only takes the lock
+ * for the list of rings and for the stats.
+ */
+
+#include <time.h>
+#include "common.h"
+#include "prefetch.h"
+
+#define PREFETCH_TABLE_SIZE 1021
+#define PREFETCH_SUCCESSORS 4	/* successors kept per file */
+#define PREFETCH_DEGREE 2	/* successors prefetched per request */
+#define PREFETCH_MIN_COUNT 2	/* times a successor must have been seen */
+#define PREFETCH_MAX_COUNT 255
+#define PREFETCH_QUEUE_SIZE 64
+#define PREFETCH_RING_SIZE 64	/* requests recorded per thread, a power of 2 */
+#define PREFETCH_NAME_LEN 256	/* longer names are not recorded */
+
+struct prefetch_successor {
+	char *name;
+	int count;
+};
+
+struct prefetch_slot {
+	char *name;
+	struct prefetch_successor next[PREFETCH_SUCCESSORS];
+};
+
+/* the requests of one worker thread, on their way to the background thread */
+struct prefetch_ring {
+	unsigned long head;	/* written by the worker thread */
+	unsigned long tail;	/* written by the background thread */
+	unsigned long dropped;	/* recorded while the ring was full */
+	char last[PREFETCH_NAME_LEN];	/* previous request drained */
+	char names[PREFETCH_RING_SIZE][PREFETCH_NAME_LEN];
+	struct prefetch_ring *next;
+};
+
+struct prefetch {
+	pthread_mutex_t lock;	/* protects rings and stats */
+	sem_t work;		/* posted for every recorded request */
+	pthread_t thread;
+	int exiting;
+	prefetch_load_fn load;
+	void *arg;
+	struct prefetch_ring *rings;
+	struct prefetch_slot table[PREFETCH_TABLE_SIZE];
+	char *queue[PREFETCH_QUEUE_SIZE];
+	int queue_in;
+	int queue_out;
+	/* bandwidth budget, a token bucket holding up to a second of reads */
+	double max_bw;
+	double tokens;
+	double refilled;	/* time of the last refill, in seconds */
+	struct prefetch_stats stats;
+};
+
+static unsigned int
+prefetch_hash(const char *name)
+{
+	unsigned int hash = 5381;
+
+	while (*name)
+		hash = hash * 33 + (unsigned char)*name++;
+	return hash % PREFETCH_TABLE_SIZE;
+}
+
+static double
+prefetch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+prefetch_slot_clear(struct prefetch_slot *slot)
+{
+	int i;
+
+	free(slot->name);
+	slot->name = NULL;
+	for (i = 0; i < PREFETCH_SUCCESSORS; i++) {
+		free(slot->next[i].name);
+		slot->next[i].name = NULL;
+		slot->next[i].count = 0;
+	}
+}
+
+/* returns the slot of file name, taking it over if it belongs to another */
+static struct prefetch_slot *
+prefetch_slot(struct prefetch *p, const char *name)
+{
+	struct prefetch_slot *slot = &p->table[prefetch_hash(name)];
+
+	if (slot->name == NULL || strcmp(slot->name, name) != 0) {
+		prefetch_slot_clear(slot);
+		slot->name = strdup(name);
+	}
+	return slot;
+}
+
+/* counts name as a successor in slot, replacing the least frequent one */
+static void
+prefetch_count(struct prefetch_slot *slot, const char *name)
+{
+	struct prefetch_successor *victim = &slot->next[0];
+	int i;
+
+	for (i = 0; i < PREFETCH_SUCCESSORS; i++) {
+		struct prefetch_successor *s = &slot->next[i];
+
+		if (s->name != NULL && strcmp(s->name, name) == 0) {
+			if (++s->count < PREFETCH_MAX_COUNT)
+				return;
+			for (i = 0; i < PREFETCH_SUCCESSORS; i++)
+				slot->next[i].count /= 2;
+			return;
+		}
+		if (s->count < victim->count)
+			victim = s;
+	}
+	free(victim->name);
+	victim->name = strdup(name);
+	victim->count = 1;
+}
+
+/* the ring of this thread */
+static __thread struct prefetch_ring *prefetch_self;
+
+/* queues a file for prefetching, unless it is queued already. called by the
+ * background thread */
+static void
+prefetch_queue(struct prefetch *p, const char *name)
+{
+	int i;
+
+	for (i = p->queue_out; i != p->queue_in;
+	     i = (i + 1) % PREFETCH_QUEUE_SIZE) {
+		if (strcmp(p->queue[i], name) == 0)
+			return;
+	}
+	if ((p->queue_in + 1) % PREFETCH_QUEUE_SIZE == p->queue_out) {
+		pthread_mutex_lock(&p->lock);
+		p->stats.dropped++;
+		pthread_mutex_unlock(&p->lock);
+		return;
+	}
+	p->queue[p->queue_in] = strdup(name);
+	p->queue_in = (p->queue_in + 1) % PREFETCH_QUEUE_SIZE;
+}
+
+void
+prefetch_record(struct prefetch *p, const char *file_name)
+{
+	struct prefetch_ring *ring = prefetch_self;
+	size_t len = strlen(file_name) + 1;
+	unsigned long head;
+
+	if (len > PREFETCH_NAME_LEN)
+		return;
+	if (ring == NULL) {
+		ring = Malloc(sizeof(struct prefetch_ring));
+		memset(ring, 0, sizeof(struct prefetch_ring));
+		pthread_mutex_lock(&p->lock);
+		ring->next = p->rings;
+		p->rings = ring;
+		pthread_mutex_unlock(&p->lock);
+		prefetch_self = ring;
+	}
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+	    PREFETCH_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return;
+	}
+	memcpy(ring->names[head % PREFETCH_RING_SIZE], file_name, len);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	sem_post(&p->work);
+}
+
+/* counts file_name as a successor of the previous request of ring, and
+ * queues the most frequent successors of file_name. called by the
+ * background thread. */
+static void
+prefetch_learn(struct prefetch *p, struct prefetch_ring *ring,
+	       const char *file_name)
+{
+	struct prefetch_slot *slot;
+	struct prefetch_successor *best[PREFETCH_DEGREE] = { NULL };
+	int i, j;
+
+	if (ring->last[0] != 0 && strcmp(ring->last, file_name) != 0)
+		prefetch_count(prefetch_slot(p, ring->last), file_name);
+	snprintf(ring->last, sizeof(ring->last), "%s", file_name);
+
+	/* the most frequent successors of this file */
+	slot = &p->table[prefetch_hash(file_name)];
+	if (slot->name != NULL && strcmp(slot->name, file_name) == 0) {
+		for (i = 0; i < PREFETCH_SUCCESSORS; i++) {
+			struct prefetch_successor *s = &slot->next[i];
+
+			if (s->count < PREFETCH_MIN_COUNT)
+				continue;
+			/* insert into best, which is sorted by count */
+			for (j = PREFETCH_DEGREE; j > 0 && (best[j - 1] == NULL ||
+			     best[j - 1]->count < s->count); j--) {
+				if (j < PREFETCH_DEGREE)
+					best[j] = best[j - 1];
+			}
+			if (j < PREFETCH_DEGREE)
+				best[j] = s;
+		}
+	}
+	for (i = 0; i < PREFETCH_DEGREE && best[i] != NULL; i++)
+		prefetch_queue(p, best[i]->name);
+}
+
+/* learns from the requests recorded in all the rings. the list of rings only
+ * grows, so it is walked from a snapshot of its head */
+static void
+prefetch_drain(struct prefetch *p)
+{
+	struct prefetch_ring *ring;
+	unsigned long head, tail;
+
+	pthread_mutex_lock(&p->lock);
+	ring = p->rings;
+	pthread_mutex_unlock(&p->lock);
+	for (; ring != NULL; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (tail = ring->tail; tail != head; tail++)
+			prefetch_learn(p, ring,
+				       ring->names[tail % PREFETCH_RING_SIZE]);
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+/* refills the bandwidth budget, and returns 0 if it is used up. called with
+ * the lock held. */
+static int
+prefetch_budget(struct prefetch *p)
+{
+	double now = prefetch_now();
+
+	p->tokens += (now - p->refilled) * p->max_bw;
+	if (p->tokens > p->max_bw)
+		p->tokens = p->max_bw;
+	p->refilled = now;
+	return p->tokens > 0;
+}
+
+static void *
+prefetch_thread(void *arg)
+{
+	struct prefetch *p = arg;
+	char *name;
+	int bytes, budget;
+
+	while (1) {
+		/* every post is for a request, and the ones drained along
+		 * with an earlier request only cost an empty pass */
+		if (p->queue_in == p->queue_out)
+			while (sem_wait(&p->work) < 0 && errno == EINTR)
+				;
+		if (__atomic_load_n(&p->exiting, __ATOMIC_ACQUIRE))
+			break;
+		prefetch_drain(p);
+		if (p->queue_in == p->queue_out)
+			continue;
+		name = p->queue[p->queue_out];
+		p->queue_out = (p->queue_out + 1) % PREFETCH_QUEUE_SIZE;
+		pthread_mutex_lock(&p->lock);
+		budget = prefetch_budget(p);
+		if (budget)
+			p->stats.issued++;
+		else
+			p->stats.dropped++;
+		pthread_mutex_unlock(&p->lock);
+		if (!budget) {
+			free(name);
+			continue;
+		}
+		bytes = p->load(p->arg, name);
+		free(name);
+		pthread_mutex_lock(&p->lock);
+		/* the budget may go negative, and then it pays off this read
+		 * before the next one */
+		p->tokens -= bytes;
+		if (bytes > 0)
+			p->stats.loaded++;
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+struct prefetch *
+prefetch_create(int max_bw, prefetch_load_fn load, void *arg)
+{
+	struct prefetch *p = Malloc(sizeof(struct prefetch));
+
+	memset(p, 0, sizeof(struct prefetch));
+	pthread_mutex_init(&p->lock, NULL);
+	sem_init(&p->work, 0, 0);
+	p->load = load;
+	p->arg = arg;
+	p->max_bw = max_bw;
+	p->tokens = max_bw;
+	p->refilled = prefetch_now();
+	if ((errno = pthread_create(&p->thread, NULL, prefetch_thread, p)))
+		unix_error("prefetch_create: pthread_create");
+	return p;
+}
+
+void
+prefetch_destroy(struct prefetch *p)
+{
+	struct prefetch_ring *ring, *next;
+	int i;
+
+	if (p == NULL)
+		return;
+	__atomic_store_n(&p->exiting, 1, __ATOMIC_RELEASE);
+	sem_post(&p->work);
+	pthread_join(p->thread, NULL);
+
+	for (; p->queue_out != p->queue_in;
+	     p->queue_out = (p->queue_out + 1) % PREFETCH_QUEUE_SIZE)
+		free(p->queue[p->queue_out]);
+	for (i = 0; i < PREFETCH_TABLE_SIZE; i++)
+		prefetch_slot_clear(&p->table[i]);
+	for (ring = p->rings; ring != NULL; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
+	/* the rings of the other threads went with them */
+	prefetch_self = NULL;
+	sem_destroy(&p->work);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+void
+prefetch_get_stats(struct prefetch *p, struct prefetch_stats *stats)
+{
+	struct prefetch_ring *ring;
+
+	pthread_mutex_lock(&p->lock);
+	*stats = p->stats;
+	for (ring = p->rings; ring != NULL; ring = ring->next)
+		stats->dropped += __atomic_load_n(&ring->dropped,
+						  __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,33 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+/* A prefetcher that learns which file tends to be requested after which, and
+ * reads the likely next files into the cache before they are requested.
+ *
+ * Every request is passed to prefetch_record(), which hands it to a
+ * background thread without taking a lock. The thread counts it as a
+ * successor of the previous request of the same worker thread, and queues
+ * the most frequent successors of the requested file. It passes them to the
+ * load function, which reads a file into the cache unless it is there
+ * already, and returns the number of bytes it read. Reads are limited to
+ * max_bw bytes per second, and files queued beyond that are dropped, as are
+ * requests recorded faster than the thread takes them. */
+struct prefetch;
+
+typedef int (*prefetch_load_fn)(void *arg, const char *file_name);
+
+struct prefetch *prefetch_create(int max_bw, prefetch_load_fn load, void *arg);
+/* stops the background thread. no calls to load are made after this */
+void prefetch_destroy(struct prefetch *p);
+void prefetch_record(struct prefetch *p, const char *file_name);
+
+/* counts of prefetched files */
+struct prefetch_stats {
+	unsigned long issued;	/* passed to the load function */
+	unsigned long loaded;	/* read into the cache */
+	unsigned long dropped;	/* over the bandwidth budget or queue */
+};
+
+void prefetch_get_stats(struct prefetch *p, struct prefetch_stats *stats);
+
+#endif /* __PREFETCH_H__ */
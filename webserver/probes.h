@@ -0,0 +1,45 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/* Static tracepoints (USDT) of the server, in the oswebserver provider. A
+ * probe is a nop instruction and a note in the binary until a tracer attaches
+ * to it, e.g.:
+ *
+ *	bpftrace -e 'usdt:./server:oswebserver:read_end { @[arg1 / 1000] = hist(arg2); }'
+ *	perf buildid-cache --add ./server; perf record -e sdt_oswebserver:send_end
+ *
+ * The arguments are computed whether or not a probe is traced, so they are
+ * values the code has at hand. Without <sys/sdt.h> (systemtap-sdt-dev), or
+ * with -DNO_PROBES, the probes are compiled out.
+ *
+ * accept(int fd, int queued)
+ *	a connection was queued for a worker thread, behind queued others
+ * dequeue(int fd, uint64_t wait_ns)
+ *	a worker thread took the connection, which waited wait_ns
+ * cache_hit(const char *file, int size, int l1)
+ *	file was found in the cache, in the thread's l1 cache if l1 is 1
+ * cache_miss(const char *file)
+ *	file was not in the cache, and is read into it
+ * cache_evict(const char *file, int size, int in_use)
+ *	file was evicted, while in_use requests or l1 caches still held it
+ * read_start(const char *file, int size, long offset)
+ *	size bytes of file, at offset, are read from storage
+ * read_end(const char *file, long bytes, uint64_t ns)
+ *	the read returned bytes, or -1, after ns
+ * send_end(int fd, int status, int length, uint64_t send_ns)
+ *	the response, of status and with length body bytes, was sent in
+ *	send_ns, and the connection is closed. status is 0 if there was none */
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES
+#endif
+#endif
+
+#ifdef PROBES
+#define PROBE(name, ...) STAP_PROBEV(oswebserver, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...) do { } while (0)
+#endif
+
+#endif /* __PROBES_H__ */
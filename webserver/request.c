@@ -2,23 +2,189 @@
  * request.c: Does the bulk of the work for the web server.
  */
 
+#define _GNU_SOURCE	/* strptime, timegm */
 #include "common.h"
 #include "request.h"
+#include "http_parse.h"
+#include "arena.h"
+#include "csum.h"
+#include "fd_cache.h"
+#include "storage.h"
+#include "doc_index.h"
+#include "archive.h"
+#include "epoch.h"
+#include "stage_timer.h"
+#include "probes.h"
+#include "watchdog.h"
+
+#define METHOD_GET  0
+#define METHOD_HEAD 1
+
+#define ETAG_LEN 64
+/* iovecs per writev() by request_sendblocks: the headers, and the blocks */
+#define IOV_BATCH (REQUEST_MAX_BLOCKS + 1)
 
 struct request {
 	int fd;		 /* descriptor for client connection */
 	struct file_data *data;
+	int method;	 /* METHOD_GET or METHOD_HEAD */
+	char *if_none_match; /* If-None-Match header, "" if absent */
+	time_t if_modified_since; /* If-Modified-Since header, 0 if absent */
+	int range_first; /* Range header, bytes=first-last. first is -1 for a */
+	int range_last;	 /* suffix range, last is -1 for an open range */
+	int has_range;	 /* 1 if a single byte range was requested */
+	struct fd_ref file; /* open file, fd is -1 until request_statfile() */
+	long long write_deadline; /* set by the first write, 0 for none */
+	int aborted;	 /* the client is gone or too slow, nothing more is
+			  * done for it */
+	int indexed;	 /* the file was found in the document root index */
+	int csum_known;	 /* data->file_csum came from the index */
+	int etag_mtime;	 /* the ETag is built from the mtime, not file_csum */
+	const char *type; /* MIME type from the index, or NULL */
+	const char *body; /* the contents of the file in the archive, or NULL */
+	struct request_info info;
 };
 
-/* requestError(fd, filename, "404", "Not found", 
+static struct fd_cache *request_fds;
+static struct storage *request_storage;
+/* connection deadlines in ns, 0 for none */
+static long long request_idle_timeout = 10000 * 1000000LL;
+static long long request_header_timeout = 10000 * 1000000LL;
+static long long request_write_timeout = 60000 * 1000000LL;
+static struct request_conn_stats request_conns;
+/* the files that can be served, or NULL to check every path. replaced while
+ * requests use it, so it is read inside an epoch (see epoch.h) */
+static struct doc_index *request_index;
+/* when not NULL, files are only served from this archive */
+static struct archive *request_archive;
+
+/* sets the descriptor cache, before the server starts */
+void
+request_set_fd_cache(struct fd_cache *cache)
+{
+	request_fds = cache;
+}
+
+/* sets the storage backend, before the server starts */
+void
+request_set_storage(struct storage *st)
+{
+	request_storage = st;
+}
+
+void
+request_set_archive(struct archive *ar)
+{
+	request_archive = ar;
+}
+
+/* sets the connection deadlines, before the server starts */
+void
+request_set_timeouts(int idle_ms, int header_ms, int write_ms)
+{
+	request_idle_timeout = idle_ms * 1000000LL;
+	request_header_timeout = header_ms * 1000000LL;
+	request_write_timeout = write_ms * 1000000LL;
+}
+
+void
+request_get_conn_stats(struct request_conn_stats *stats)
+{
+	stats->idle = __atomic_load_n(&request_conns.idle, __ATOMIC_RELAXED);
+	stats->header = __atomic_load_n(&request_conns.header,
+					__ATOMIC_RELAXED);
+	stats->write = __atomic_load_n(&request_conns.write, __ATOMIC_RELAXED);
+	stats->disconnected = __atomic_load_n(&request_conns.disconnected,
+					      __ATOMIC_RELAXED);
+	stats->cancelled = __atomic_load_n(&request_conns.cancelled,
+					   __ATOMIC_RELAXED);
+}
+
+/* counts a connection that was cut short */
+static void
+request_count(unsigned long *counter)
+{
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* checks whether the client has gone away, e.g., while its request was
+ * queued, so that the expensive stages of the request can be skipped. only
+ * a connection that can't take a response any more counts, i.e., one that
+ * was reset or shut down both ways. a client that shuts down just its side
+ * after sending the request (POLLRDHUP) may still be waiting for the
+ * response, so it gets one. */
+static int
+request_client_gone(struct request *rq)
+{
+	struct pollfd pfd = { rq->fd, 0 };
+
+	if (rq->aborted)
+		return 1;
+	if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR))) {
+		request_count(&request_conns.cancelled);
+		rq->aborted = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/* nanoseconds since an arbitrary point, for the deadlines of a request */
+static long long
+request_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ends a stage of a request that started at start, a stage_clock() time.
+ * returns its duration in ns, for the access log */
+static long long
+request_stage_end(int stage, uint64_t start)
+{
+	uint64_t ticks = stage_clock() - start;
+
+	stage_add(stage, ticks);
+	return stage_ns(ticks);
+}
+
+/* writes a response to the client. status and length describe it for the
+ * access log. all the writes of a response must be done before the write
+ * deadline. once it has passed, or the client has gone away, the rest of the
+ * response is dropped. */
+static void
+request_send(struct request *rq, struct iovec *iov, int iovcnt, int status,
+	     int length)
+{
+	uint64_t start = stage_clock();
+
+	if (rq->aborted)
+		return;
+	watchdog_stage(STAGE_WRITE);
+	if (rq->write_deadline == 0 && request_write_timeout > 0)
+		rq->write_deadline = request_clock() + request_write_timeout;
+	if (Rio_writev_until(rq->fd, iov, iovcnt, rq->write_deadline) < 0) {
+		request_count(errno == ETIMEDOUT ? &request_conns.write :
+			      &request_conns.disconnected);
+		rq->aborted = 1;
+	}
+	rq->info.send_ns += request_stage_end(STAGE_WRITE, start);
+	rq->info.status = status;
+	rq->info.length += length;
+}
+
+/* requestError(rq, filename, "404", "Not found", 
  *		"OS server could not find this file");
  */
 static void
-request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+request_error(struct request *rq, char *cause, char *errnum, char *shortmsg,
+	      char *longmsg)
 {
 	char buf[MAXLINE], body[MAXBUF];
-	int i;
-	unsigned int csum = 0;
+	unsigned int csum;
+	struct iovec iov[2];
+	long size = 0;
 
 	/* create the body of the error message */
 	sprintf(body, "<html><title>OS Web Server Error</title>");
@@ -27,46 +193,155 @@ request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 	sprintf(body, "%s<p>%s: %s</p>\r\n", body, longmsg, cause);
 	sprintf(body, "%s</body></html>\r\n", body);
 
-	/* write out the header information for this response */
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	/* put together the header information for this response */
+	size += sprintf(buf + size, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+	size += sprintf(buf + size, "Content-Type: text/html\r\n");
+	size += sprintf(buf + size, "Content-Length: %ld\r\n", strlen(body));
+	/* generate a very trivial checksum */
+	csum = csum_update(0, body, strlen(body));
+	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
+
+	/* write out the headers and the content together */
+	iov[0].iov_base = buf;
+	iov[0].iov_len = size;
+	iov[1].iov_base = body;
+	iov[1].iov_len = strlen(body);
+	request_send(rq, iov, 2, atoi(errnum), iov[1].iov_len);
 
-	sprintf(buf, "Content-Type: text/html\r\n");
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+}
 
-	sprintf(buf, "Content-Length: %ld\r\n", strlen(body));
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+/* parses an HTTP date (RFC 1123 format). returns 0 if it can't be parsed. */
+static time_t
+request_parse_date(char *date)
+{
+	struct tm tm;
 
-	/* generate a very trivial checksum */
-	for (i = 0; i < strlen(body); i++) {
-		csum += (unsigned char)(body[i]);
-	}
-	sprintf(buf, "Content-Csum: %u\r\n\r\n", csum);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	memset(&tm, 0, sizeof(tm));
+	if (strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+		return 0;
+	return timegm(&tm);
+}
 
-	/* write out the content */
-	Rio_write(fd, body, strlen(body));
-	printf("%s", body);
+/* formats t as an HTTP date into buf, which should be at least 64 bytes */
+static void
+request_format_date(time_t t, char *buf, size_t max)
+{
+	struct tm tm;
 
+	gmtime_r(&t, &tm);
+	strftime(buf, max, "%a, %d %b %Y %H:%M:%S GMT", &tm);
 }
 
-/* reads and discards everything up to an empty text line */
+/* parses a "bytes=first-last" Range header. multiple ranges are not
+ * supported, and such requests are served the whole file. */
 static void
-request_read_headers(struct rio *rp)
+request_parse_range(struct request *rq, char *value)
 {
-	char buf[MAXLINE];
+	int first = -1, last = -1;
+	char *end;
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+	if (strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ','))
+		return;
+	value += 6;
+	if (*value != '-') {
+		first = strtol(value, &end, 10);
+		if (end == value || first < 0)
+			return;
+		value = end;
+	}
+	if (*value++ != '-')
+		return;
+	if (isdigit(*value)) {
+		last = strtol(value, &end, 10);
+		value = end;
+	}
+	if (*value != 0 || (first < 0 && last < 0) ||
+	    (last >= 0 && first > last))
+		return;
+	rq->range_first = first;
+	rq->range_last = last;
+	rq->has_range = 1;
+}
+
+/* reads the request line and the headers from the client into buf, and
+ * parses them in place. returns the length of the request, 0 if the client
+ * closed the connection before sending a complete request, and -1 if the
+ * request is malformed or doesn't fit in buf. */
+static int
+request_read_request(struct request *rq, char *buf, int max,
+		     struct http_request *req)
+{
+	long long deadline = 0;
+	int len = 0, n, ret;
+
+	/* a non-blocking socket is polled until the idle deadline for the first
+	 * byte, and then until the header deadline for the rest */
+	if (request_idle_timeout > 0)
+		deadline = request_clock() + request_idle_timeout;
+	while (len < max) {
+		n = read(rq->fd, buf + len, max - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (Rio_wait(rq->fd, POLLIN, deadline) == 0) {
+				request_count(len == 0 ?
+						  &request_conns.idle :
+						  &request_conns.header);
+				return 0;
+			}
+			continue;
+		}
+		if (n <= 0)
+			return 0;
+		if (len == 0) {
+			deadline = 0;
+			if (request_header_timeout > 0)
+				deadline = request_clock() +
+					request_header_timeout;
+		}
+		len += n;
+		/* most requests arrive in one read, so reparsing from the
+		 * start is cheaper than keeping the parser state */
+		ret = http_parse_request(buf, len, req);
+		if (ret != 0)
+			return ret;
 	}
-	return;
+	return -1;
 }
 
+/* remembers the conditional and range request headers, and ignores the
+ * rest. the values are copied out of the slices to be NUL terminated: the
+ * If-None-Match list, which can hold any number of ETags, into the arena,
+ * and the others, which are short, into a buffer. */
+static void
+request_parse_headers(struct request *rq, struct http_request *req,
+		      struct arena *arena)
+{
+	char value[ETAG_LEN];
+	struct http_header *h;
+	int i;
+
+	rq->if_none_match = "";
+	rq->if_modified_since = 0;
+	rq->has_range = 0;
+	for (i = 0; i < req->nr_headers; i++) {
+		h = &req->headers[i];
+		if (http_slice_equals(&h->name, "If-None-Match")) {
+			rq->if_none_match = arena_alloc(arena,
+							h->value.len + 1);
+			memcpy(rq->if_none_match, h->value.p, h->value.len);
+			rq->if_none_match[h->value.len] = '\0';
+			continue;
+		}
+		snprintf(value, sizeof(value), "%.*s", h->value.len,
+			 h->value.p);
+		if (http_slice_equals(&h->name, "If-Modified-Since")) {
+			rq->if_modified_since = request_parse_date(value);
+		} else if (http_slice_equals(&h->name, "Range")) {
+			request_parse_range(rq, value);
+		}
+	}
+}
 
 /* Calculates filename from uri. 
  * for this simple server, filename = .uri
@@ -76,23 +351,68 @@ request_read_headers(struct rio *rp)
  *
  * Also, we don't serve files with a .. in the path (see request_readfile). */
 static void
-request_parse_URI(char *uri, char *filename, size_t max)
+request_parse_URI(struct http_slice *uri, char *filename, size_t max)
 {
-	snprintf(filename, max, "./%s", uri);
+	snprintf(filename, max, "./%.*s", uri->len, uri->p);
 }
 
-/* Fills in the filetype given the filename */
 static void
-request_get_file_type(char *filename, char *filetype)
-{
-	if (strstr(filename, ".html"))
-		strcpy(filetype, "text/html");
-	else if (strstr(filename, ".gif"))
-		strcpy(filetype, "image/gif");
-	else if (strstr(filename, ".jpg"))
-		strcpy(filetype, "image/jpeg");
-	else
-		strcpy(filetype, "text/plain");
+request_free_index(void *index)
+{
+	doc_index_free(index);
+}
+
+/* builds an index of source, a directory or a fileset manifest (see
+ * doc_index.h), and puts it in place of the current one. requests that
+ * are using the old index keep it until they are done. returns the number
+ * of files in the index, or -1 with errno set, keeping the old index. */
+int
+request_load_index(const char *source)
+{
+	struct doc_index *index, *old;
+
+	if ((index = doc_index_build(source, doc_servable)) == NULL)
+		return -1;
+	old = __atomic_exchange_n(&request_index, index, __ATOMIC_ACQ_REL);
+	if (old != NULL)
+		epoch_retire(old, request_free_index);
+	return doc_index_count(index);
+}
+
+void
+request_unload_index(void)
+{
+	epoch_drain();	/* frees the indexes that were replaced */
+	doc_index_free(__atomic_exchange_n(&request_index, NULL,
+					   __ATOMIC_ACQ_REL));
+}
+
+/* looks up the file of data in the index, and fills in data from it.
+ * returns 1 if the file is indexed, 0 if it isn't, and -1 if there is no
+ * index. */
+static int
+request_index_lookup(struct file_data *data, int *csum_known,
+		     const char **type)
+{
+	const struct doc_entry *entry;
+	struct doc_index *index;
+	int ret = -1;
+
+	epoch_enter();
+	index = __atomic_load_n(&request_index, __ATOMIC_ACQUIRE);
+	if (index != NULL) {
+		entry = doc_index_lookup(index, data->file_name);
+		ret = entry != NULL;
+		if (entry != NULL) {
+			data->file_size = entry->size;
+			data->file_mtime = entry->mtime;
+			data->file_csum = entry->csum;
+			*csum_known = entry->has_csum;
+			*type = entry->type;	/* a string constant */
+		}
+	}
+	epoch_exit();
+	return ret;
 }
 
 /* entry point to this file */
@@ -101,112 +421,298 @@ request_get_file_type(char *filename, char *filetype)
  * Returns NULL on failure.
  */
 struct request *
-request_init(int connfd, struct file_data *data)
+request_init(int connfd, struct file_data *data, struct arena *arena)
 {
-	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	struct rio *rio;
+	char buf[MAXBUF], method[16];
+	struct http_request req;
 	struct request *rq;
+	int ret;
 
 	assert(data);
-	rq = Malloc(sizeof(struct request));
+	rq = arena_alloc(arena, sizeof(struct request));
 	rq->fd = connfd;
 	rq->data = data;
-	data->file_name = Malloc(MAXLINE);
+	rq->file.fd = -1;
+	rq->file.entry = NULL;
+	rq->write_deadline = 0;
+	rq->aborted = 0;
+	rq->indexed = 0;
+	rq->csum_known = 0;
+	rq->etag_mtime = 0;
+	rq->type = NULL;
+	rq->body = NULL;
+	memset(&rq->info, 0, sizeof(rq->info));
+	data->file_name = arena_alloc(arena, MAXLINE);
 	data->file_buf = NULL;
 	data->file_size = 0;
-	rio = Rio_init(rq->fd);
-	Rio_readlineb(rio, buf, MAXLINE);
-	sscanf(buf, "%s %s %s", method, uri, version);
+	data->file_csum = 0;
+	data->file_mtime = 0;
+	data->file_result = NULL;
+	ret = request_read_request(rq, buf, MAXBUF, &req);
+	if (ret <= 0) {
+		if (ret < 0) {
+			request_error(rq, "request", "400", "Bad Request",
+				      "OS Web Server could not parse this");
+		}
+		request_destroy(rq);
+		return NULL;
+	}
 
-	// printf("%s %s %s, fd = %d\n", method, uri, version, connfd);
-	if (strcasecmp(method, "GET")) {
-		request_error(rq->fd, method, "501", "Not Implemented",
+	if (http_slice_equals(&req.method, "GET")) {
+		rq->method = METHOD_GET;
+	} else if (http_slice_equals(&req.method, "HEAD")) {
+		rq->method = METHOD_HEAD;
+	} else {
+		snprintf(method, sizeof(method), "%.*s", req.method.len,
+			 req.method.p);
+		request_error(rq, method, "501", "Not Implemented",
 			     "OS Web Server does not implement this method");
-		Rio_destroy(rio);
 		request_destroy(rq);
 		return NULL;
 	}
-	request_read_headers(rio);
-	request_parse_URI(uri, data->file_name, MAXLINE);
-	Rio_destroy(rio);
+	request_parse_headers(rq, &req, arena);
+	request_parse_URI(&req.uri, data->file_name, MAXLINE);
 	return rq;
 }
 
+const struct request_info *
+request_get_info(struct request *rq)
+{
+	return &rq->info;
+}
+
 void
 request_destroy(struct request *rq)
 {
 	assert(rq);
+	PROBE(send_end, rq->fd, rq->info.status, rq->info.length,
+	      rq->info.send_ns);
+	watchdog_end();
 	/* close the connection fd */
 	SYS(close(rq->fd));
-	free(rq);
+	if (rq->file.fd >= 0)
+		fd_cache_put(request_fds, &rq->file);
 }
 
-/* read in filename corresponding to request. 
- * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
- * Returns 0 on failure, sends error to client. */
+/* request_statfile() for a server with an archive. the archive has
+ * everything that is needed to describe the file. */
+static int
+request_statarchive(struct request *rq)
+{
+	const struct archive_file *file;
+	struct file_data *data = rq->data;
+	char *why;
+
+	if ((why = doc_check_path(data->file_name)) != NULL) {
+		request_error(rq, data->file_name, "404", "Not found", why);
+		return 0;
+	}
+	file = archive_lookup(request_archive, data->file_name);
+	if (file == NULL) {
+		request_error(rq, data->file_name, "404", "Not found",
+			      "OS Web Server could not find this file");
+		return 0;
+	}
+	data->file_size = file->size;
+	data->file_mtime = file->mtime;
+	data->file_csum = file->csum;
+	rq->csum_known = 1;
+	rq->body = archive_body(request_archive, file);
+	return 1;
+}
+
+/* checks that the filename corresponding to request can be served.
+ * Returns 1 on success, and fills rq->file_size and rq->file_mtime.
+ * Returns 0 on failure, sends error to client. with an index, files that
+ * aren't in it are not found, without looking at the file system. */
 int
-request_readfile(struct request *rq)
+request_statfile(struct request *rq)
 {
-	int srcfd;
-	struct stat sbuf;
+	struct stat *sbuf = &rq->file.st;
 	struct file_data *data;
-	char *ext;
+	char *why;
+	int indexed;
 
 	data = rq->data;
 	assert(data);
 
-	/* don't serve files that start with /, or .., or end in .c */
-	if (data->file_name[0] == '/') {
-		/* this shouldn't really happen because we add a "./" at the
-		 * beginning of the file path */
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with absolute paths");
-		return 0;
-	}
-	if (strstr(data->file_name, "..") != NULL) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with .. in the path");
+	if (request_archive != NULL)
+		return request_statarchive(rq);
+	if (rq->file.fd >= 0)	/* already opened by an earlier call */
+		goto out;
+
+	indexed = request_index_lookup(data, &rq->csum_known, &rq->type);
+	if (indexed == 0) {
+		request_error(rq, data->file_name, "404", "Not found",
+			      "OS Web Server could not find this file");
 		return 0;
 	}
-	if (((ext = strrchr(data->file_name, '.')) != NULL) && 
-	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve C or header files ");
+	rq->indexed = indexed > 0;
+	if (!rq->indexed &&
+	    (why = doc_check_path(data->file_name)) != NULL) {
+		request_error(rq, data->file_name, "404", "Not found", why);
 		return 0;
 	}
 
-	if (stat(data->file_name, &sbuf) < 0) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server could not find this file");
+	if (fd_cache_get(request_fds, data->file_name, &rq->file) < 0) {
+		if (errno == EACCES) {
+			request_error(rq, data->file_name, "403",
+				      "Forbidden",
+				      "OS Web Server could not read this file");
+		} else {
+			request_error(rq, data->file_name, "404",
+				      "Not found",
+				      "OS Web Server could not find this file");
+		}
 		return 0;
 	}
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-		request_error(rq->fd, data->file_name, "403", "Forbidden",
+	if (!(S_ISREG(sbuf->st_mode)) || !(S_IRUSR & sbuf->st_mode)) {
+		fd_cache_put(request_fds, &rq->file);
+		request_error(rq, data->file_name, "403", "Forbidden",
 			      "OS Web Server could not read this file");
 		return 0;
 	}
+out:
+	if (!rq->indexed || data->file_size != sbuf->st_size ||
+	    data->file_mtime != sbuf->st_mtime) {
+		/* not indexed, or changed since the index was built */
+		data->file_size = sbuf->st_size;
+		data->file_mtime = sbuf->st_mtime;
+		data->file_csum = 0;
+		rq->csum_known = 0;
+	}
+	return 1;
+}
 
-	data->file_size = sbuf.st_size;
+/* read in filename corresponding to request. 
+ * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+ * Returns 0 on failure, sends error to client, or if the client is gone. */
+int
+request_readfile(struct request *rq)
+{
+	int srcfd;
+	uint64_t start, ns;
+	ssize_t size;
+	struct file_data *data;
+
+	data = rq->data;
+	assert(data);
 
+	if (!request_statfile(rq) || request_client_gone(rq))
+		return 0;
+
+	if (rq->body != NULL) {
+		/* in the archive, which stays mapped while the server runs */
+		data->file_buf = (char *)rq->body;
+		return 1;
+	}
 	if (data->file_size) {
-		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
+		srcfd = rq->file.fd;
 		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
-		/* ask the kernel to stop caching the file */
-		SYS(posix_fadvise(srcfd, 0, data->file_size, 
-				  POSIX_FADV_DONTNEED));
-		SYS(close(srcfd));
-		/* we do this to simulate a slow disk. otherwise, file caching
-		 * doesn't have much benefit because a lot of the time is spent
-		 * in processing (see request_processfile below) and so
-		 * request_readfile does not have much impact. */
-		usleep(10000);
+		/* the default backend simulates a slow disk. otherwise, file
+		 * caching doesn't have much benefit because a lot of the time
+		 * is spent in processing (see request_processfile below) and
+		 * so request_readfile does not have much impact. */
+		PROBE(read_start, data->file_name, data->file_size, 0L);
+		watchdog_stage(STAGE_READ);
+		start = stage_clock();
+		size = storage_read(request_storage, srcfd, data->file_buf,
+				    data->file_size, 0);
+		ns = request_stage_end(STAGE_READ, start);
+		rq->info.read_ns += ns;
+		PROBE(read_end, data->file_name, (long)size, ns);
+		if (size != data->file_size) {
+			/* file shrank since it was stat'ed */
+			request_error(rq, data->file_name, "500",
+				      "Internal Server Error",
+				      "OS Web Server could not read this file");
+			return 0;
+		}
+		/* generate a very trivial checksum, which also serves as the
+		 * ETag of the file, unless the index has it already */
+		if (!rq->csum_known) {
+			watchdog_stage(STAGE_CSUM);
+			start = stage_begin();
+			data->file_csum = csum_update(0, data->file_buf,
+						      data->file_size);
+			stage_end(STAGE_CSUM, start);
+		}
 	}
 	return 1;
 }
 
+/* a block of the file of rq could not be read: a 500 is sent, unless the
+ * response has been started, and then the client gets a short body */
+static void
+request_readblock_failed(struct request *rq)
+{
+	if (rq->info.status != 0) {
+		rq->aborted = 1;
+		return;
+	}
+	request_error(rq, rq->data->file_name, "500", "Internal Server Error",
+		      "OS Web Server could not read this file");
+}
+
+/* read in block block_nr of the file corresponding to request, i.e., the
+ * bytes starting at block_nr * block_size, into block->file_buf and
+ * block->file_size. request_statfile() must have been called before.
+ * Returns 1 on success, 0 on failure, sends error to client, or if the
+ * client is gone. once a response has been started, a failure cuts it short
+ * instead. */
+int
+request_readblock(struct request *rq, struct file_data *block, int block_nr,
+		  int block_size)
+{
+	int srcfd;
+	uint64_t start, ns;
+	ssize_t size;
+	off_t offset;
+	struct file_data *data;
+
+	data = rq->data;
+	assert(data && block);
+
+	if (request_client_gone(rq))
+		return 0;
+	offset = (off_t)block_nr * block_size;
+	if (offset >= data->file_size) {
+		request_readblock_failed(rq);
+		return 0;
+	}
+	block->file_size = data->file_size - offset;
+	if (block->file_size > block_size)
+		block->file_size = block_size;
+	block->file_mtime = data->file_mtime;
+	block->file_buf = Malloc(block->file_size);
+	if (rq->body != NULL) {
+		/* in the archive */
+		memcpy(block->file_buf, rq->body + offset, block->file_size);
+	} else {
+		srcfd = rq->file.fd;
+		assert(srcfd >= 0);
+		PROBE(read_start, data->file_name, block->file_size,
+		      (long)offset);
+		watchdog_stage(STAGE_READ);
+		start = stage_clock();
+		size = storage_read(request_storage, srcfd, block->file_buf,
+				    block->file_size, offset);
+		ns = request_stage_end(STAGE_READ, start);
+		rq->info.read_ns += ns;
+		PROBE(read_end, data->file_name, (long)size, ns);
+		if (size != block->file_size) {
+			/* file shrank since it was stat'ed */
+			request_readblock_failed(rq);
+			return 0;
+		}
+	}
+	watchdog_stage(STAGE_CSUM);
+	start = stage_begin();
+	block->file_csum = csum_update(0, block->file_buf, block->file_size);
+	stage_end(STAGE_CSUM, start);
+	return 1;
+}
+
 /* if you have previous file data, you can reuse it */
 void
 request_set_data(struct request *rq, struct file_data *data)
@@ -214,57 +720,447 @@ request_set_data(struct request *rq, struct file_data *data)
 	rq->data = data;
 }
 
-/* process file, the main reason for this function is that if we don't do enough
- * processing on the file, the network becomes the bottleneck, and then the
- * various server parameters have no affect on server performance. this is a
- * problem because we have 100 Mb/s network. With faster networks, we wouldn't
- * have to do this artificial work. */
+/* returns 0 if the response to this request carries no body (HEAD) */
+int
+request_has_body(struct request *rq)
+{
+	return rq->method != METHOD_HEAD;
+}
+
+/* the processing result of the file of rq, if it is sent in place of the
+ * file, or else NULL */
+static struct file_result *
+request_result(struct request *rq)
+{
+	struct file_result *result;
+
+	result = __atomic_load_n(&rq->data->file_result, __ATOMIC_ACQUIRE);
+	return result == &request_processed ? NULL : result;
+}
+
+/* the size of the body sent for the file of rq */
+static int
+request_body_size(struct request *rq)
+{
+	struct file_result *result = request_result(rq);
+
+	return result != NULL ? result->size : rq->data->file_size;
+}
+
+/* resolves the requested byte range against the body size of rq->data.
+ * Returns 1 and sets *first and *last (inclusive) for a partial request,
+ * 0 if the whole file should be sent, and -1 if the range can't be
+ * satisfied. */
+int
+request_get_range(struct request *rq, int *first, int *last)
+{
+	int size;
+
+	assert(rq->data);
+	if (!rq->has_range)
+		return 0;
+	size = request_body_size(rq);
+	if (rq->range_first < 0) { /* suffix range, the last bytes */
+		if (rq->range_last == 0 || size == 0)
+			return -1;
+		*first = size - rq->range_last;
+		if (*first < 0)
+			*first = 0;
+		*last = size - 1;
+		return 1;
+	}
+	if (rq->range_first >= size)
+		return -1;
+	*first = rq->range_first;
+	*last = rq->range_last;
+	if (*last < 0 || *last >= size)
+		*last = size - 1;
+	return 1;
+}
+
+/* builds the ETag of the file from its checksum and size, or from its mtime
+ * and size, as a weak ETag, if the checksum isn't known (see
+ * request_use_mtime_etag()). a processing result that is sent instead of
+ * the file has an ETag of its own. */
 static void
-request_processfile(struct request *rq)
+request_get_etag(struct request *rq, char *etag, size_t max)
+{
+	struct file_data *data = rq->data;
+	struct file_result *result = request_result(rq);
+
+	if (result != NULL)
+		snprintf(etag, max, "\"%08x-%x\"", result->csum,
+			 result->size);
+	else if (rq->etag_mtime && !rq->csum_known)
+		snprintf(etag, max, "W/\"%lx-%x\"", (long)data->file_mtime,
+			 data->file_size);
+	else
+		snprintf(etag, max, "\"%08x-%x\"", data->file_csum,
+			 data->file_size);
+}
+
+/* files that are too large to be read whole for their checksum, e.g., the
+ * ones served in blocks, get an ETag built from their mtime instead, unless
+ * the index has their checksum */
+void
+request_use_mtime_etag(struct request *rq)
+{
+	rq->etag_mtime = 1;
+}
+
+/* returns 1 if the copy of the file that the client has cached is still
+ * valid, based on the If-None-Match and If-Modified-Since headers. only the
+ * metadata in rq->data (size, checksum, mtime) is needed, not the file
+ * contents. */
+int
+request_not_modified(struct request *rq)
 {
+	char etag[ETAG_LEN];
 	struct file_data *data;
-	int i, j, dummy;
+
 	data = rq->data;
 	assert(data);
+	if (rq->if_none_match[0]) {
+		/* If-None-Match takes precedence over If-Modified-Since */
+		if (strcmp(rq->if_none_match, "*") == 0)
+			return 1;
+		request_get_etag(rq, etag, ETAG_LEN);
+		return strstr(rq->if_none_match, etag) != NULL;
+	}
+	if (rq->if_modified_since) {
+		return data->file_mtime <= rq->if_modified_since;
+	}
+	return 0;
+}
+
+/* the default processing stage. the main reason for this function is that if
+ * we don't do enough processing on the file, the network becomes the
+ * bottleneck, and then the various server parameters have no affect on server
+ * performance. this is a problem because we have 100 Mb/s network. With
+ * faster networks, we wouldn't have to do this artificial work. the file
+ * itself is sent. */
+static unsigned int request_process_dummy;
+
+static struct file_result *
+request_process_default(const char *buf, int size)
+{
+	unsigned int dummy = 0;
+	int i;
 
 	for (i = 0; i < 128; i++) {
-		for (j = 0; j < data->file_size; j++) {
-			dummy += (unsigned char)(data->file_buf[j]);
-		}
+		dummy = csum_update(dummy, buf, size);
 	}
+	/* kept, so that the work isn't optimized away */
+	__atomic_store_n(&request_process_dummy, dummy, __ATOMIC_RELAXED);
+	return &request_processed;
+}
+
+static request_process_fn request_process = request_process_default;
+struct file_result request_processed;
+
+/* sets the processing stage, before the server starts */
+void
+request_set_process(request_process_fn fn)
+{
+	request_process = fn;
+}
+
+int
+request_process_replaces(void)
+{
+	return request_process != request_process_default;
+}
+
+void
+request_free_result(struct file_result *result)
+{
+	if (result != &request_processed)
+		free(result);
+}
+
+/* runs the processing stage on the contents of data */
+static struct file_result *
+request_run_process(struct file_data *data)
+{
+	struct file_result *result;
+
+	result = request_process(data->file_buf, data->file_size);
+	if (result != &request_processed)
+		result->csum = csum_update(0, result->buf, result->size);
+	return result;
 }
 
-/* send filename to the fd connection */
+/* process file, unless it has been processed already, or the client is gone.
+ * the result is stored in the file data, which may be a cache entry shared
+ * with other threads, so it is published with a compare and swap, and a
+ * thread that loses the race throws its result away. */
+void
+request_processfile(struct request *rq)
+{
+	struct file_data *data;
+	struct file_result *result, *none = NULL;
+	uint64_t start;
+	data = rq->data;
+	assert(data);
+
+	if (__atomic_load_n(&data->file_result, __ATOMIC_ACQUIRE) != NULL ||
+	    request_client_gone(rq))
+		return;
+	watchdog_stage(STAGE_PROCESS);
+	start = stage_clock();
+	result = request_run_process(data);
+	rq->info.process_ns += request_stage_end(STAGE_PROCESS, start);
+	if (!__atomic_compare_exchange_n(&data->file_result, &none, result, 0,
+					 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		request_free_result(result);
+}
+
+/* reads and processes file data->file_name without a request, e.g., to
+ * prefetch it. fills in data like request_readfile(), but doesn't send
+ * anything. files larger than max_size are not read. returns 1 on success,
+ * 0 on failure. */
+int
+request_loadfile(struct file_data *data, int max_size)
+{
+	struct fd_ref file;
+	const char *type;
+	int ret = 0, indexed, csum_known;
+
+	indexed = request_index_lookup(data, &csum_known, &type);
+	if (indexed == 0 ||
+	    (indexed < 0 && doc_check_path(data->file_name) != NULL) ||
+	    fd_cache_get(request_fds, data->file_name, &file) < 0)
+		return 0;
+	if (!S_ISREG(file.st.st_mode) || file.st.st_size > max_size)
+		goto out;
+	csum_known = indexed > 0 && csum_known &&
+		data->file_size == file.st.st_size &&
+		data->file_mtime == file.st.st_mtime;
+	data->file_size = file.st.st_size;
+	data->file_mtime = file.st.st_mtime;
+	data->file_buf = Malloc(data->file_size > 0 ? data->file_size : 1);
+	if (storage_read(request_storage, file.fd, data->file_buf,
+			 data->file_size, 0) != data->file_size)
+		goto out;
+	if (!csum_known)
+		data->file_csum = csum_update(0, data->file_buf,
+					      data->file_size);
+	data->file_result = request_run_process(data);
+	ret = 1;
+out:
+	fd_cache_put(request_fds, &file);
+	return ret;
+}
+
+/* tells the client that the requested byte range is outside the file */
+static void
+request_send_unsatisfiable(struct request *rq)
+{
+	char buf[MAXBUF];
+	struct iovec iov;
+	long size = 0;
+
+	size += sprintf(buf + size, "HTTP/1.0 416 Range Not Satisfiable\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += sprintf(buf + size, "Content-Range: bytes */%d\r\n",
+			request_body_size(rq));
+	size += sprintf(buf + size, "Content-Length: 0\r\n");
+	size += sprintf(buf + size, "Content-Csum: 0\r\n\r\n");
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	request_send(rq, &iov, 1, 416, 0);
+}
+
+void
+request_send_text(struct request *rq, const char *type, const char *body,
+		  int length)
+{
+	char buf[MAXLINE];
+	struct iovec iov[2];
+	long size = 0;
+
+	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += sprintf(buf + size, "Content-Type: %s\r\n", type);
+	size += sprintf(buf + size, "Content-Length: %d\r\n", length);
+	size += sprintf(buf + size, "Cache-Control: no-store\r\n");
+	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n",
+			csum_update(0, body, length));
+	iov[0].iov_base = buf;
+	iov[0].iov_len = size;
+	iov[1].iov_base = (void *)body;
+	iov[1].iov_len = length;
+	if (request_has_body(rq))
+		request_send(rq, iov, 2, 200, length);
+	else
+		request_send(rq, iov, 1, 200, 0);
+}
+
+/* send filename to the fd connection. sends a 304 response without a body if
+ * the client's copy is still valid, and only the headers for HEAD requests.
+ * the body is the processing result of the file, if the processing stage
+ * replaced it. */
 void
 request_sendfile(struct request *rq)
 {
-	char filetype[MAXLINE], buf[MAXBUF];
-	int i;
+	char buf[MAXBUF];
+	const char *filetype;
+	char etag[ETAG_LEN], date[64];
+	int partial, first, last, length;
 	unsigned int csum = 0;
 	struct file_data *data;
+	struct file_result *result;
+	struct iovec iov[2];
+	char *body;
 	long size = 0;
 
 	data = rq->data;
 	assert(data);
 
-	request_get_file_type(data->file_name, filetype);
-	/* generate a very trivial checksum */
-	for (i = 0; i < data->file_size; i++) {
-		csum += (unsigned char)(data->file_buf[i]);
+	request_get_etag(rq, etag, ETAG_LEN);
+	request_format_date(data->file_mtime, date, sizeof(date));
+	if (request_not_modified(rq)) {
+		size += sprintf(buf + size, "HTTP/1.0 304 Not Modified\r\n");
+		size += sprintf(buf + size, "Server: OS Web Server\r\n");
+		size += sprintf(buf + size, "ETag: %s\r\n", etag);
+		size += sprintf(buf + size, "Last-Modified: %s\r\n\r\n", date);
+		iov[0].iov_base = buf;
+		iov[0].iov_len = size;
+		request_send(rq, iov, 1, 304, 0);
+		return;
+	}
+
+	/* a stage that may replace the body runs first, as the range is
+	 * resolved against the body. HEAD requests only need it for the
+	 * length and ETag of that body. such a stage means that the file has
+	 * been read whole (see request_process_replaces()) */
+	if (request_process_replaces()) {
+		request_processfile(rq);
+	}
+	partial = request_get_range(rq, &first, &last);
+	if (partial < 0) {
+		request_send_unsatisfiable(rq);
+		return;
 	}
 	/* do some processing */
-	request_processfile(rq);
+	if (request_has_body(rq)) {
+		request_processfile(rq);
+	}
+	if ((result = request_result(rq)) != NULL) {
+		request_get_etag(rq, etag, ETAG_LEN);
+		body = result->buf;
+	} else {
+		body = data->file_buf;
+	}
+
+	filetype = rq->type ? rq->type : doc_mime_type(data->file_name);
 	/* put together response */
-	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
+	if (partial) {
+		length = last - first + 1;
+		csum = csum_update(0, body + first, length);
+		size += sprintf(buf + size, "HTTP/1.0 206 Partial Content\r\n");
+	} else {
+		first = 0;
+		length = request_body_size(rq);
+		csum = result != NULL ? result->csum : data->file_csum;
+		size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
+	}
 	size += sprintf(buf + size, "Server: OS Web Server\r\n");
 	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
-	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
+	size += sprintf(buf + size, "Content-Length: %d\r\n", length);
+	if (partial) {
+		size += sprintf(buf + size, "Content-Range: bytes %d-%d/%d\r\n",
+				first, last, request_body_size(rq));
+	}
+	size += sprintf(buf + size, "Accept-Ranges: bytes\r\n");
+	size += sprintf(buf + size, "ETag: %s\r\n", etag);
+	size += sprintf(buf + size, "Last-Modified: %s\r\n", date);
 	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
 
-	Rio_write(rq->fd, buf, strlen(buf));
+	/* writes the headers and the body to the client socket with one
+	 * system call, so that small responses go out in one segment */
+	iov[0].iov_base = buf;
+	iov[0].iov_len = size;
+	iov[1].iov_base = body + first;
+	iov[1].iov_len = request_has_body(rq) ? length : 0;
+	request_send(rq, iov, iov[1].iov_len > 0 ? 2 : 1, partial ? 206 : 200,
+		     iov[1].iov_len);
+}
+
+/* send part of the requested byte range of a file to the fd connection, when
+ * the file is not in memory as a whole but as a sequence of consecutive blocks
+ * of block_size bytes: the part in the nr_blocks blocks starting with block
+ * number first_block. the parts are sent in order, and the first one goes out
+ * with the headers. Content-Csum is only sent when all the blocks of the range
+ * are passed at once, as it comes before them. blocks is NULL for HEAD
+ * requests, which get just the headers. the caller takes care of 304 and 416
+ * responses, which need no blocks either.
+ * Returns 0 if the rest of the response should not be sent, e.g., because
+ * the client is gone. */
+int
+request_sendblocks(struct request *rq, struct file_data **blocks,
+		   int first_block, int nr_blocks, int block_size)
+{
+	char buf[MAXBUF], etag[ETAG_LEN], date[64];
+	const char *filetype;
+	int first, last, b, start, end, n = 0, length = 0;
+	unsigned int csum = 0;
+	struct file_data *data;
+	struct iovec iov[IOV_BATCH];
+	long size = 0;
+
+	data = rq->data;
+	assert(data && nr_blocks < IOV_BATCH);
+
+	if (request_get_range(rq, &first, &last) <= 0)
+		return 0;
+	if (first_block > first / block_size)
+		goto body;
+	if (blocks != NULL && first_block + nr_blocks > last / block_size) {
+		/* the checksum covers just the bytes in the range */
+		for (b = first / block_size; b <= last / block_size; b++) {
+			struct file_data *block = blocks[b - first_block];
+			start = (b == first / block_size) ?
+				first % block_size : 0;
+			end = (b == last / block_size) ?
+				last % block_size : block->file_size - 1;
+			csum = csum_update(csum, block->file_buf + start,
+					   end - start + 1);
+		}
+	}
+	filetype = rq->type ? rq->type : doc_mime_type(data->file_name);
+	request_get_etag(rq, etag, ETAG_LEN);
+	request_format_date(data->file_mtime, date, sizeof(date));
+	size += sprintf(buf + size, "HTTP/1.0 206 Partial Content\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
+	size += sprintf(buf + size, "Content-Length: %d\r\n", last - first + 1);
+	size += sprintf(buf + size, "Content-Range: bytes %d-%d/%d\r\n",
+			first, last, data->file_size);
+	size += sprintf(buf + size, "Accept-Ranges: bytes\r\n");
+	size += sprintf(buf + size, "ETag: %s\r\n", etag);
+	size += sprintf(buf + size, "Last-Modified: %s\r\n", date);
+	if (blocks != NULL && first_block + nr_blocks > last / block_size)
+		size += sprintf(buf + size, "Content-Csum: %u\r\n", csum);
+	size += sprintf(buf + size, "\r\n");
+	iov[n].iov_base = buf;
+	iov[n++].iov_len = size;
+	if (blocks == NULL || !request_has_body(rq)) {
+		request_send(rq, iov, n, 206, 0);
+		return 0;
+	}
 
-	/* writes data->file_buf to the client socket */
-	if (data->file_size > 0) {
-		Rio_write(rq->fd, data->file_buf, data->file_size);
+body:
+	/* the headers go out with the first blocks */
+	for (b = first_block; b < first_block + nr_blocks; b++) {
+		struct file_data *block = blocks[b - first_block];
+		start = (b == first / block_size) ? first % block_size : 0;
+		end = (b == last / block_size) ?
+			last % block_size : block->file_size - 1;
+		iov[n].iov_base = block->file_buf + start;
+		iov[n++].iov_len = end - start + 1;
+		length += end - start + 1;
 	}
+	request_send(rq, iov, n, 206, length);
+	return !rq->aborted;
 }
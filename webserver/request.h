@@ -1,16 +1,115 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+#include <time.h>
+
+struct arena;
+
+/* output of the processing stage for a file: the body that is sent for it,
+ * in place of its contents. a file that has a result has been processed,
+ * and is not processed again while it is cached. */
+struct file_result {
+	int size;
+	unsigned int csum;	/* csum_update() of buf, filled in by the server */
+	char buf[];
+};
+
+/* a result without contents, that says the file was processed, and that its
+ * own contents are sent. it must not be freed. */
+extern struct file_result request_processed;
+
 struct file_data {
 	char *file_name; /* name of file being requested */
 	char *file_buf;	 /* file is read into this buffer in memory */
 	int file_size;	 /* file size */
+	unsigned int file_csum;	/* trivial checksum of file_buf, used as ETag */
+	time_t file_mtime;	/* last modification time, for Last-Modified */
+	struct file_result *file_result; /* NULL until the file is processed */
+};
+
+/* the processing stage, run on the contents of a file before its body is
+ * sent. the result must only depend on the contents, so that a cached file
+ * needs to be processed only once. returns a Malloc'ed result, which is sent
+ * instead of the file, or &request_processed to send the file itself. */
+typedef struct file_result *(*request_process_fn)(const char *buf, int size);
+void request_set_process(request_process_fn fn);
+/* returns 1 if a processing stage was set, which may replace the body of a
+ * file, so that the file can only be served whole, not in blocks */
+int request_process_replaces(void);
+void request_free_result(struct file_result *result);
+
+/* files are opened through this cache, or directly if it is NULL */
+struct fd_cache;
+void request_set_fd_cache(struct fd_cache *cache);
+/* files are read from this backend, or the file system if it is NULL */
+struct storage;
+void request_set_storage(struct storage *st);
+/* files are only served from this archive, if it isn't NULL. then
+ * request_readfile() points data->file_buf into the archive, instead of
+ * allocating it, and the caller must not free it (see archive.h) */
+struct archive;
+void request_set_archive(struct archive *ar);
+
+/* deadlines for the client connection, in ms, 0 for none: for the first byte
+ * of the request, for the rest of the request header after that, and for the
+ * whole response. a client that misses one is disconnected. the socket should
+ * be non-blocking, or a stalled client can still block a read or write. */
+void request_set_timeouts(int idle_ms, int header_ms, int write_ms);
+
+/* serves only the files in an index of source, a directory or a fileset
+ * manifest (see doc_index.h), without checking their paths or looking for
+ * other files. may be called again while requests are served, to replace the
+ * index. returns the number of files indexed, or -1 with errno set. */
+int request_load_index(const char *source);
+/* drops the index, once no requests are served */
+void request_unload_index(void);
+
+/* counts of connections that were cut short */
+struct request_conn_stats {
+	unsigned long idle;	/* missed a deadline */
+	unsigned long header;
+	unsigned long write;
+	unsigned long disconnected; /* went away while being sent to */
+	unsigned long cancelled; /* went away before their file was read or
+				  * processed, which was then skipped */
+};
+
+void request_get_conn_stats(struct request_conn_stats *stats);
+
+/* what happened to a request, for the access log */
+struct request_info {
+	int status;		/* HTTP status of the response, 0 if none */
+	int length;		/* body bytes sent */
+	long long read_ns;	/* time spent reading the file */
+	long long process_ns;	/* time spent processing it */
+	long long send_ns;	/* time spent sending the response */
 };
 
-struct request *request_init(int connfd, struct file_data *data);
+/* the request and the file name are allocated from arena, so they live until
+ * the arena is reset */
+struct request *request_init(int connfd, struct file_data *data,
+			     struct arena *arena);
+int request_statfile(struct request *rq);
 int request_readfile(struct request *rq);
+int request_loadfile(struct file_data *data, int max_size);
+int request_readblock(struct request *rq, struct file_data *block,
+		      int block_nr, int block_size);
+void request_processfile(struct request *rq);
 void request_set_data(struct request *rq, struct file_data *data);
+int request_has_body(struct request *rq);
+int request_not_modified(struct request *rq);
+void request_use_mtime_etag(struct request *rq);
+int request_get_range(struct request *rq, int *first, int *last);
 void request_sendfile(struct request *rq);
+/* sends a 200 response with a body generated by the server, e.g., its
+ * metrics, which clients must not cache */
+void request_send_text(struct request *rq, const char *type, const char *body,
+		       int length);
+int request_sendblocks(struct request *rq, struct file_data **blocks,
+		       int first_block, int nr_blocks, int block_size);
+/* largest nr_blocks for request_sendblocks() */
+#define REQUEST_MAX_BLOCKS 63
+const struct request_info *request_get_info(struct request *rq);
 void request_destroy(struct request *rq);
 
 #endif
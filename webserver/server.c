@@ -1,13 +1,58 @@
+#define _GNU_SOURCE	/* accept4, ppoll */
 #include <malloc.h>
 #include "common.h"
 #include "request.h"
 #include "server_thread.h"
+#include "shm_cache.h"
+#include "storage.h"
 
 /* 
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [-P nr_procs] [-S storage] [-F prefetch_mbps] [-L access_log]
+ *	[-T idle,header,write] [-I doc_index] [-A archive] [-W stuck_ms[,close]]
+ *	portnum nr_threads max_requests max_cache_size
+ *
+ * With -P, the server forks nr_procs worker processes that accept connections
+ * on the same port, each with nr_threads worker threads. The worker processes
+ * share one cache of max_cache_size bytes in shared memory.
+ *
+ * With -S, files are read from the given storage backend (see storage.h),
+ * e.g., -S fs for the plain file system, or -S hdd:qd=4 for a simulated
+ * disk. By default, every read takes an extra 10 ms.
+ *
+ * With -F, files that are likely to be requested next, given the order of
+ * earlier requests, are read into the cache at up to prefetch_mbps MB/s.
+ * This needs a cache, and is not supported with -P.
+ *
+ * With -L, every request is logged to the file access_log, and to a binary
+ * trace in access_log.trace (see access_log.h).
+ *
+ * With -T, clients are disconnected when they take longer than idle ms to
+ * start sending a request, header ms to send the rest of it, or write ms to
+ * take the response. 0 disables a deadline. The default is 10000,10000,60000.
+ *
+ * With -I, only the files in doc_index, a directory or a fileset manifest, are
+ * served (see doc_index.h). The index is built at startup, and rebuilt when
+ * the server gets a SIGHUP.
+ *
+ * With -A, all files are served from archive, packed by the pack tool (see
+ * archive.h), which is mapped into memory when the server starts. The cache,
+ * -I, -S and -F are not used then.
+ *
+ * With -W, a watchdog reports requests that a worker thread has been on for
+ * longer than stuck_ms to stderr, with the stage of the request they are
+ * stuck in (see watchdog.h). With ,close, their connections are also shut
+ * down, to free the thread.
+ *
+ * On a SIGUSR1, the server prints the percentiles of the latencies of the
+ * requests it has served so far, and where their time went, which it also
+ * prints when it exits.
+ *
+ * A GET of /__metrics returns the counters of the server, its cache, queue
+ * and workers, and its latency histograms, in the Prometheus text format. With
+ * -P, they are those of the worker process that took the connection.
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
  * is done within routines written in server_thread.c and request.c
@@ -16,13 +61,63 @@
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
-		"max_cache_size\n", program);
+	fprintf(stderr, "Usage: %s [-P nr_procs] [-S storage] [-F prefetch_mbps] "
+		"[-L access_log] [-T idle,header,write] [-I doc_index] "
+		"[-A archive] [-W stuck_ms[,close]] port nr_threads max_requests "
+		"max_cache_size\n",
+		program);
 	exit(1);
 }
 
 static char *fifo = "./server_exit";
 
+/* SIGHUP and SIGUSR1 are blocked, except while the main thread of a process
+ * waits in ppoll() with this mask, so that they interrupt the wait and nothing
+ * else */
+static sigset_t wait_mask;
+static volatile sig_atomic_t reload_requested;	/* SIGHUP */
+static volatile sig_atomic_t report_requested;	/* SIGUSR1 */
+
+static void
+signal_handler(int sig)
+{
+	if (sig == SIGHUP)
+		reload_requested = 1;
+	else
+		report_requested = 1;
+}
+
+static void
+catch_signals(void)
+{
+	struct sigaction sa;
+	sigset_t mask;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sigemptyset(&sa.sa_mask);
+	SYS(sigaction(SIGHUP, &sa, NULL));
+	SYS(sigaction(SIGUSR1, &sa, NULL));
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	/* threads created after this, and forked workers, inherit the mask */
+	SYS(sigprocmask(SIG_BLOCK, &mask, &wait_mask));
+	sigdelset(&wait_mask, SIGHUP);
+	sigdelset(&wait_mask, SIGUSR1);
+}
+
+/* returns 1 once for every time the signal of requested arrived while
+ * waiting */
+static int
+signal_pending(volatile sig_atomic_t *requested)
+{
+	if (!*requested)
+		return 0;
+	*requested = 0;
+	return 1;
+}
+
 /* we will use this fifo to send a message to the server to exit */
 static int
 open_fifo(void)
@@ -52,21 +147,221 @@ close_fifo(void)
 	unlink(fifo);
 }
 
+/* accept and serve connections on listenfd, until stopfd becomes readable or
+ * is hung up */
+static void
+server_loop(struct server *sv, int listenfd, int stopfd)
+{
+	int connfd, clientlen;
+	struct sockaddr_in clientaddr;
+
+	struct pollfd fds[] = {
+		{stopfd, POLLIN},
+		{listenfd, POLLIN},
+	};
+	int ret;
+
+	while (1) {
+		/* wait for either a client to connect or an exit event */
+		ret = ppoll(fds, 2, NULL, &wait_mask);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;	/* a signal, handled below */
+		SYS(ret);
+		if (signal_pending(&reload_requested))
+			server_reload(sv);
+		if (signal_pending(&report_requested))
+			server_report(sv);
+		if (ret == 0)
+			continue;
+
+		if (fds[0].revents & (POLLIN | POLLHUP)) { /* exit requested */
+			break;
+		}
+
+		assert(fds[1].revents & POLLIN); /* connect request arrived */
+		clientlen = sizeof(clientaddr);
+		/* connfd is the socket descriptor the server will use to send
+		 * data to the client. it is non-blocking, so that a slow client
+		 * can be timed out (see request_set_timeouts()) */
+		connfd = accept4(listenfd, (struct sockaddr *)&clientaddr,
+				 (socklen_t *) & clientlen, SOCK_NONBLOCK);
+		if (connfd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+				   errno == ECONNABORTED)) {
+			/* another worker process accepted this connection, or
+			 * the client gave up */
+			continue;
+		}
+		SYS(connfd);
+
+		/* serve the request */
+		server_request(sv, connfd);
+	}
+}
+
+/* fork a worker process that serves connections until the write end of the
+ * stopfds pipe is closed by the parent */
+static pid_t
+prefork_worker(int listenfd, int stopfds[2], int nr_threads, int max_requests,
+	       int max_cache_size, struct server_opts *opts)
+{
+	struct server *sv;
+	pid_t pid;
+
+	SYS(pid = fork());
+	if (pid > 0)
+		return pid;
+	SYS(close(stopfds[1]));
+	sv = server_init_opts(nr_threads, max_requests, max_cache_size, opts);
+	server_loop(sv, listenfd, stopfds[0]);
+	server_exit(sv);
+	exit(0);
+}
+
+/* run nr_procs worker processes, replacing any worker that dies, until an
+ * exit is requested on exitfd */
+static void
+prefork_server(int nr_procs, int listenfd, int exitfd, int nr_threads,
+	       int max_requests, int max_cache_size, struct server_opts *opts)
+{
+	pid_t *workers, pid;
+	int stopfds[2];
+	int i, status, flags;
+
+	if (max_cache_size > 0 && opts->archive == NULL)
+		opts->shm_cache = shm_cache_create(max_cache_size);
+	/* the workers poll the listening socket together, so accept must not
+	 * block in the workers that lose the race for a connection */
+	SYS(flags = fcntl(listenfd, F_GETFL, 0));
+	SYS(fcntl(listenfd, F_SETFL, flags | O_NONBLOCK));
+	/* the workers exit when the write end of this pipe is closed */
+	SYS(pipe(stopfds));
+	workers = Malloc(sizeof(pid_t) * nr_procs);
+	for (i = 0; i < nr_procs; i++) {
+		workers[i] = prefork_worker(listenfd, stopfds, nr_threads,
+					    max_requests, max_cache_size,
+					    opts);
+	}
+
+	struct pollfd fds[] = {
+		{exitfd, POLLIN},
+	};
+	struct timespec second = { 1, 0 };
+	int ret;
+
+	while (1) {
+		/* check for dead workers every second */
+		ret = ppoll(fds, 1, &second, &wait_mask);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;	/* a signal, handled below */
+		SYS(ret);
+		/* each worker has its own index and latencies */
+		if (signal_pending(&reload_requested)) {
+			for (i = 0; i < nr_procs; i++)
+				kill(workers[i], SIGHUP);
+		}
+		if (signal_pending(&report_requested)) {
+			for (i = 0; i < nr_procs; i++)
+				kill(workers[i], SIGUSR1);
+		}
+		if (fds[0].revents & POLLIN) { /* exit requested */
+			break;
+		}
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < nr_procs; i++) {
+				if (workers[i] != pid)
+					continue;
+				fprintf(stderr, "worker %d died, restarting\n",
+					pid);
+				if (opts->shm_cache != NULL)
+					shm_cache_release(opts->shm_cache, pid);
+				workers[i] = prefork_worker(listenfd,
+							    stopfds,
+							    nr_threads,
+							    max_requests,
+							    max_cache_size,
+							    opts);
+			}
+		}
+	}
+
+	SYS(close(stopfds[1]));
+	for (i = 0; i < nr_procs; i++) {
+		waitpid(workers[i], &status, 0);
+	}
+	SYS(close(stopfds[0]));
+	free(workers);
+	shm_cache_destroy(opts->shm_cache);
+}
+
 int
 main(int argc, char *argv[])
 {
 	int port, nr_threads, max_requests, max_cache_size;
-	int listenfd, connfd, clientlen;
+	int nr_procs = 0;
+	int listenfd, opt;
 	int exitfd;
-	struct sockaddr_in clientaddr;
 	struct server *sv;
+	struct server_opts opts;
 
-	if (argc != 5)
+	/* a client that goes away mid-response makes writes fail with EPIPE,
+	 * which is handled for that connection, instead of killing the server */
+	signal(SIGPIPE, SIG_IGN);
+	catch_signals();
+	server_opts_init(&opts);
+	while ((opt = getopt(argc, argv, "P:S:F:L:T:I:A:W:")) != -1) {
+		switch (opt) {
+		case 'P':
+			nr_procs = atoi(optarg);
+			if (nr_procs <= 0)
+				usage(argv[0]);
+			break;
+		case 'S':
+			/* created before forking, so that a simulated device
+			 * is shared by all the worker processes */
+			opts.storage = storage_create(optarg);
+			if (opts.storage == NULL) {
+				fprintf(stderr, "unknown storage %s\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'F':
+			opts.prefetch_bw = atoi(optarg) * 1000000;
+			if (opts.prefetch_bw <= 0)
+				usage(argv[0]);
+			break;
+		case 'L':
+			opts.access_log = optarg;
+			break;
+		case 'T':
+			if (sscanf(optarg, "%d,%d,%d", &opts.idle_timeout,
+				   &opts.header_timeout,
+				   &opts.write_timeout) != 3 ||
+			    opts.idle_timeout < 0 || opts.header_timeout < 0 ||
+			    opts.write_timeout < 0)
+				usage(argv[0]);
+			break;
+		case 'I':
+			opts.doc_index = optarg;
+			break;
+		case 'A':
+			opts.archive = optarg;
+			break;
+		case 'W':
+			opts.watchdog_ms = atoi(optarg);
+			opts.watchdog_close = strstr(optarg, ",close") != NULL;
+			if (opts.watchdog_ms <= 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 4)
 		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
+	port = atoi(argv[optind]);
+	nr_threads = atoi(argv[optind + 1]);
+	max_requests = atoi(argv[optind + 2]);
+	max_cache_size = atoi(argv[optind + 3]);
 	if (port < 1024) {
 		fprintf(stderr, "port = %d, should be >= 1024\n", port);
 		usage(argv[0]);
@@ -75,37 +370,27 @@ main(int argc, char *argv[])
 		fprintf(stderr, "arguments should be > 0\n");
 		usage(argv[0]);
 	}
+
+	if (nr_procs > 0) {
+		listenfd = open_listenfd(port);
+		exitfd = open_fifo();
+		prefork_server(nr_procs, listenfd, exitfd, nr_threads,
+			       max_requests, max_cache_size, &opts);
+		close_fifo();
+		storage_destroy(opts.storage);
+		exit(0);
+	}
 	
-	sv = server_init(nr_threads, max_requests, max_cache_size);
+	sv = server_init_opts(nr_threads, max_requests, max_cache_size, &opts);
 
 	listenfd = open_listenfd(port);
 	exitfd = open_fifo();
 
-	struct pollfd fds[] = {
-		{exitfd, POLLIN},
-		{listenfd, POLLIN},
-	};
-	while (1) {
-		/* wait for either a client to connect or an exit event */
-		SYS(poll(fds, 2, -1));
-		
-		if(fds[0].revents & POLLIN) { /* exit requested */
-			break;
-		}
-
-		assert(fds[1].revents & POLLIN); /* connect request arrived */
-		clientlen = sizeof(clientaddr);
-		/* connfd is the socket descriptor the server will use to send
-		 * data to the client */
-		SYS(connfd = accept(listenfd, (struct sockaddr *)&clientaddr,
-				    (socklen_t *) & clientlen));
-
-		/* serve the request */
-		server_request(sv, connfd);
-	}
+	server_loop(sv, listenfd, exitfd);
 	
 	close_fifo();
 	server_exit(sv);
+	storage_destroy(opts.storage);
 
 	/* we don't check for memory leaks using mallinfo() because pthreads
 	 * caches thread state even after a thread exits so that it can reuse
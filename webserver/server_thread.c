@@ -1,52 +1,56 @@
 #include "request.h"
 #include "server_thread.h"
 #include "common.h"
+#include "shm_cache.h"
+#include "epoch.h"
+#include "arena.h"
+#include "fd_cache.h"
+#include "storage.h"
+#include "prefetch.h"
+#include "access_log.h"
+#include "archive.h"
+#include "histogram.h"
+#include "stage_timer.h"
+#include "lock.h"
+#include "probes.h"
+#include "watchdog.h"
 
 /* --------------------------------------------------------------------------------------- */
 /* global variables */
 
 #define CACHE_TABLE_SIZE 3571
-pthread_mutex_t B_LOCK = PTHREAD_MUTEX_INITIALIZER; // buffer lock
+#define CACHE_BLOCK_SIZE 65536 // max size of the blocks of files too large to cache whole
+#define CACHE_MIN_BLOCK_SIZE 4096
+#define L1_CACHE_SIZE 8		// entries in the per-thread l1 cache
+#define L1_AGE_INTERVAL 1024 // l1 hit counts are halved after this many lookups
+#define FD_CACHE_SIZE 256	 // default number of files kept open
+struct lock B_LOCK = LOCK_INITIALIZER("buffer");	// buffer lock
 pthread_cond_t B_FULL = PTHREAD_COND_INITIALIZER;   // buffer full cv
 pthread_cond_t B_EMPTY = PTHREAD_COND_INITIALIZER;  // buffer empty cv
 int B_IN = 0;										// buffer in index
 int B_OUT = 0;										// buffer out index
-pthread_mutex_t C_LOCK = PTHREAD_MUTEX_INITIALIZER; // cache lock
+struct lock C_LOCK = LOCK_INITIALIZER("cache");		// cache lock, taken by inserts and evictions only
+pthread_mutex_t H_LOCK = PTHREAD_MUTEX_INITIALIZER; // per-thread statistics list lock
 
-/* --------------------------------------------------------------------------------------- */
-/* request least recently used (lru) linked list structure */
-
-typedef struct lru_node
-{
-	char *fileName;
-	struct lru_node *next;
-	struct lru_node *prev;
-} lru_node;
-
-typedef struct lru_list
-{
-	int listSize;
-	lru_node *head;
-	lru_node *tail;
-} lru_list;
-
-lru_list *lru_list_init(void);
-void lru_list_destroy(lru_list *list);
-lru_node *lru_list_search(lru_list *list, struct file_data *file_data);
-void lru_list_insert_at_first(lru_list *list, struct file_data *file_data);
-int lru_list_remove_first(lru_list *list);
-int lru_list_remove_last(lru_list *list);
-int lru_list_remove_one(lru_list *list, struct file_data *file_data);
-int lru_list_move_to_head(lru_list *list, struct file_data *file_data);
+#define METRICS_PATH "__metrics" // reserved, answered with the server's metrics
 
 /* --------------------------------------------------------------------------------------- */
 /* cache hash table structure */
 
+/* lookups walk the hash chains without taking C_LOCK, inside an epoch (see epoch.h), so
+ * entries removed from the table are only freed after all lookups that could see them
+ * are done. */
 typedef struct cache_ht_entry
 {
 	struct file_data *fileData;
-	int inUse;
-	struct cache_ht_entry *next;
+	int inUse;						  // number of references: the cache's own until eviction, requests sending it, and l1 caches holding it
+	int evicted;					  // removed from the cache, retired when the last reference is dropped
+	int retired;					  // handed to epoch_retire()
+	int accessed;					  // set by hits, cleared by the clock hand
+	int prefetched;					  // read by the prefetcher, and not requested since
+	struct cache_ht_entry *next;	  // hash chain
+	struct cache_ht_entry *clockNext; // clock ring, protected by C_LOCK
+	struct cache_ht_entry *clockPrev;
 } cache_ht_entry;
 
 typedef struct cache_hash_table
@@ -61,6 +65,10 @@ void cache_ht_destroy(cache_hash_table *hashTable);
 cache_ht_entry *cache_ht_insert(cache_hash_table *hashTable, struct file_data *data);
 cache_ht_entry *cache_ht_search(cache_hash_table *hashTable, char *fileName);
 int cache_ht_delete(cache_hash_table *hashTable, struct file_data *data);
+int cache_entry_get(cache_ht_entry *entry);
+void cache_entry_put(cache_ht_entry *entry);
+static void cache_entry_retire(cache_ht_entry *entry);
+static void cache_entry_free(void *entry);
 
 /* --------------------------------------------------------------------------------------- */
 /* cache structure */
@@ -70,8 +78,12 @@ typedef struct server_cache
 	int maxSize;
 	int maxTableSize;
 	int curSize;
+	int blockSize; // files larger than maxSize are cached in blocks of this size
+	int nrEntries;
 	cache_hash_table *hashTable;
-	lru_list *lruOrder;
+	cache_ht_entry *clockHand; // next eviction candidate, entries are replaced in clock order
+	unsigned long prefetchWasted; // prefetched entries evicted before they were requested
+	unsigned long evictions;
 } server_cache;
 
 struct server_cache *cache_init(int maxSize);
@@ -79,10 +91,77 @@ void cache_destroy(server_cache *cache);
 cache_ht_entry *cache_insert(server_cache *cache, struct file_data *fileData);
 cache_ht_entry *cache_lookup(server_cache *cache, char *fileName);
 int cache_evict(server_cache *cache, int size);
+static void cache_clock_insert(server_cache *cache, cache_ht_entry *entry);
+static void cache_clock_remove(server_cache *cache, cache_ht_entry *entry);
+
+/* --------------------------------------------------------------------------------------- */
+/* per-thread l1 cache, holding references to the hottest entries of the server cache */
+
+typedef struct l1_slot
+{
+	cache_ht_entry *entry;
+	int hash;
+	unsigned int hits;
+} l1_slot;
+
+typedef struct l1_cache
+{
+	l1_slot slot[L1_CACHE_SIZE];
+	unsigned int lookups;
+} l1_cache;
+
+static __thread l1_cache L1; // zeroed for every new thread
+
+cache_ht_entry *l1_lookup(char *fileName);
+void l1_insert(cache_ht_entry *entry);
+void l1_release(void);
+
+/* --------------------------------------------------------------------------------------- */
+/* per-thread latency histograms and counters, written without locks by their thread, and
+ * added up when they are reported, while the threads keep serving requests */
+
+enum
+{
+	LATENCY_SERVICE, // from when a worker takes a request until it is done with it
+	LATENCY_HIT,	 // the same, for requests served from the cache
+	LATENCY_MISS,	 // the same, for requests read into the cache
+	LATENCY_QUEUE,	 // from when a request is accepted until a worker takes it
+	LATENCY_NR
+};
+
+static const char *latencyNames[LATENCY_NR] = {"service", "hit", "miss", "queue"};
+
+typedef struct thread_stats
+{
+	struct histogram hist[LATENCY_NR];
+	unsigned long results[ACCESS_NR]; // requests served, by how they were served
+	unsigned long bytes;			  // body bytes sent
+	int busy;						  // serving a request
+	struct thread_stats *next;		  // on the list of the server, protected by H_LOCK
+} thread_stats;
+
+static __thread thread_stats *ThreadStats; // this thread's statistics, or NULL
+
+// only the thread itself writes its statistics, the stores are atomic so that readers don't
+// see torn values
+#define STATS_SET(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define STATS_ADD(field, n) STATS_SET(field, (field) + (n))
 
 /* --------------------------------------------------------------------------------------- */
 /* server structure */
 
+static __thread struct arena Arena; // per-thread, holds the state of the current request
+
+typedef struct server_stats
+{
+	unsigned long requests;
+	unsigned long heapAllocs;  // Malloc() calls made while serving requests
+	unsigned long arenaAllocs; // allocations served by the arena instead
+	unsigned long writes;	   // write system calls to the clients
+	unsigned long prefetchHits; // requests for files that were prefetched
+	unsigned long blockHits;	// block-served requests that didn't read from storage
+} server_stats;
+
 typedef struct server
 {
 	int exiting;
@@ -90,18 +169,45 @@ typedef struct server
 	pthread_t **worker_thread;
 	int max_requests;
 	int *request_buff;
+	uint64_t *request_time; // when each queued request was accepted
 	int max_cache_size;
 	server_cache *cache;
+	struct shm_cache *shm; // cache shared by prefork worker processes, or NULL
+	struct fd_cache *fds;  // open files, relative to the current directory
+	struct storage *storage;
+	int own_storage;	   // storage was created by server_init_opts
+	struct prefetch *prefetch; // reads likely next files into the cache, or NULL
+	struct access_log *log;	   // or NULL
+	const char *docIndex;	   // source of the document root index, or NULL
+	pthread_mutex_t reloadLock; // protects the fields below
+	pthread_t reloadThread;	   // rebuilds the index in the background
+	int reloading;			   // reloadThread is running
+	int reloadStarted;		   // reloadThread has to be joined
+	int reloadAgain;		   // reload requested while reloading
+	struct archive *archive;   // mapped archive all files are served from, or NULL
+	struct watchdog *watchdog; // reports stuck worker threads, or NULL
+	server_stats stats;
+	thread_stats *threadStats; // statistics of every thread that served requests
 } server;
 
 /* server and file data function declarations */
 void worker_thread(server *sv);
 struct server *server_init(int nr_threads, int max_requests, int max_cache_size);
 void server_request(struct server *sv, int connfd);
-static void do_server_request(struct server *sv, int connfd);
+static void do_server_request(struct server *sv, int connfd, uint64_t accepted);
 void server_exit(struct server *sv);
 static struct file_data *file_data_init(void);
 static void file_data_free(struct file_data *data);
+static char *file_buf_dup(struct file_data *data);
+static struct file_result *file_result_dup(struct file_data *data);
+static void do_server_entry(struct request *rq, struct file_data *data, cache_ht_entry *entry);
+static void do_server_blocks(struct server *sv, struct request *rq, struct file_data *data);
+static int do_server_shm(struct server *sv, struct request *rq, struct file_data *data);
+static void do_server_log(struct server *sv, struct request *rq, struct file_data *data,
+						  int result, uint64_t start, uint64_t parsed);
+static int do_server_prefetch(void *arg, const char *fileName);
+static int do_server_is_metrics(struct file_data *data);
+static void do_server_metrics(struct server *sv, struct request *rq);
 
 /* --------------------------------------------------------------------------------------- */
 
@@ -114,6 +220,9 @@ static struct file_data *file_data_init(void)
 	data->file_name = NULL;
 	data->file_buf = NULL;
 	data->file_size = 0;
+	data->file_csum = 0;
+	data->file_mtime = 0;
+	data->file_result = NULL;
 	return data;
 }
 
@@ -122,23 +231,494 @@ static void file_data_free(struct file_data *data)
 {
 	free(data->file_name);
 	free(data->file_buf);
+	request_free_result(data->file_result);
 	free(data);
 }
 
-static void do_server_request(struct server *sv, int connfd)
+/* copy the processing result, if there is one */
+static struct file_result *file_result_dup(struct file_data *data)
+{
+	struct file_result *result = data->file_result;
+	struct file_result *copy;
+	if (result == NULL || result == &request_processed)
+		return result;
+	copy = Malloc(sizeof(struct file_result) + result->size);
+	memcpy(copy, result, sizeof(struct file_result) + result->size);
+	return copy;
+}
+
+/* copy the file contents, which may contain any bytes, so strdup doesn't work */
+static char *file_buf_dup(struct file_data *data)
+{
+	char *buf = Malloc(data->file_size > 0 ? data->file_size : 1);
+	if (data->file_size > 0)
+		memcpy(buf, data->file_buf, data->file_size);
+	return buf;
+}
+
+/* serve a range request for a file too large to be cached whole. the file is
+ * cached as fixed-size blocks, keyed by "<file name> <block number>", so that
+ * the hot regions of the file can stay in the cache. a space can never appear
+ * in a requested file name, so the block keys don't collide with file names.
+ * the range is sent a batch of blocks at a time, which are only held until
+ * they are sent, so that a large range doesn't have to fit in memory. */
+static void do_server_blocks(struct server *sv, struct request *rq, struct file_data *data)
+{
+	int first, last, first_block, last_block, nr_blocks, b, i, sent;
+	int block_size = sv->cache->blockSize;
+	char key[MAXLINE + 16];
+	struct file_data *blocks[REQUEST_MAX_BLOCKS];
+	cache_ht_entry *pinned[REQUEST_MAX_BLOCKS];
+
+	if (request_get_range(rq, &first, &last) <= 0 || request_not_modified(rq))
+	{ // 416 or 304, no blocks needed
+		request_sendfile(rq);
+		return;
+	}
+	first_block = first / block_size;
+	last_block = last / block_size;
+	if (!request_has_body(rq))
+	{ // HEAD, the headers don't need the blocks
+		request_sendblocks(rq, NULL, first_block, 0, block_size);
+		return;
+	}
+	for (b = first_block; b <= last_block; b += nr_blocks)
+	{
+		nr_blocks = last_block - b + 1;
+		if (nr_blocks > REQUEST_MAX_BLOCKS)
+			nr_blocks = REQUEST_MAX_BLOCKS;
+		sent = 1;
+		for (i = 0; i < nr_blocks; i++)
+		{
+			struct file_data *block;
+			snprintf(key, sizeof(key), "%s %d", data->file_name, b + i);
+			epoch_enter();
+			pinned[i] = cache_lookup(sv->cache, key);
+			if (pinned[i] != NULL && !cache_entry_get(pinned[i]))
+				pinned[i] = NULL;
+			epoch_exit();
+			if (pinned[i] != NULL)
+			{ // block exists in cache, keep it there until it is sent
+				blocks[i] = pinned[i]->fileData;
+				continue;
+			}
+			block = file_data_init();
+			block->file_name = strdup(key);
+			if (request_readblock(rq, block, b + i, block_size) == 0)
+			{ // file changed underneath us (a 500 was sent, or the response cut short), or the client is gone
+				file_data_free(block);
+				nr_blocks = i;
+				sent = 0;
+				break;
+			}
+			lock_acquire(&C_LOCK);
+			pinned[i] = cache_insert(sv->cache, block);
+			if (pinned[i] != NULL)
+			{
+				cache_entry_get(pinned[i]);
+				blocks[i] = pinned[i]->fileData;
+				file_data_free(block);
+			}
+			else
+			{ // no room in the cache, use a private copy
+				blocks[i] = block;
+			}
+			lock_release(&C_LOCK);
+		}
+		if (sent)
+			sent = request_sendblocks(rq, blocks, b, nr_blocks, block_size);
+		for (i = 0; i < nr_blocks; i++)
+		{
+			if (pinned[i] != NULL)
+				cache_entry_put(pinned[i]);
+			else
+				file_data_free(blocks[i]);
+		}
+		if (!sent)
+			break;
+	}
+}
+
+/* serve a request from the cache shared with the other worker processes. hits
+ * are sent straight from the shared region while the entry is pinned. returns
+ * how the request was served, for the access log. */
+static int do_server_shm(struct server *sv, struct request *rq, struct file_data *data)
+{
+	watchdog_stage(STAGE_LOOKUP);
+	uint64_t lookup = stage_begin();
+	size_t ref = shm_cache_get(sv->shm, data);
+	stage_end(STAGE_LOOKUP, lookup);
+	if (ref != 0)
+	{ // file data exists in cache, processed
+		PROBE(cache_hit, data->file_name, data->file_size, 0);
+		request_sendfile(rq);
+		data->file_buf = NULL; // owned by the shared cache
+		data->file_result = NULL;
+		shm_cache_put(sv->shm, ref);
+		return ACCESS_HIT;
+	}
+	PROBE(cache_miss, data->file_name);
+	if (request_readfile(rq) == 0)
+	{ /* couldn't read file */
+		return ACCESS_MISS;
+	}
+	if (!request_not_modified(rq))
+		request_processfile(rq); // only processed files are cached
+	shm_cache_insert(sv->shm, data);
+	request_sendfile(rq);
+	return ACCESS_MISS;
+}
+
+/* read a file that the prefetcher expects to be requested soon into the cache.
+ * returns the number of bytes read. */
+static int do_server_prefetch(void *arg, const char *fileName)
 {
-	int ret;
+	struct server *sv = (struct server *)arg;
+	struct file_data *data;
+	cache_ht_entry *entry;
+	int size = 0;
+
+	// this thread doesn't use epochs, lookups under C_LOCK are safe too
+	lock_acquire(&C_LOCK);
+	entry = cache_ht_search(sv->cache->hashTable, (char *)fileName);
+	lock_release(&C_LOCK);
+	if (entry != NULL)
+		return 0;
+	data = file_data_init();
+	data->file_name = strdup(fileName);
+	if (request_loadfile(data, sv->cache->maxSize))
+	{
+		size = data->file_size;
+		lock_acquire(&C_LOCK);
+		entry = cache_insert(sv->cache, data);
+		if (entry != NULL)
+			__atomic_store_n(&entry->prefetched, 1, __ATOMIC_RELAXED);
+		lock_release(&C_LOCK);
+	}
+	file_data_free(data);
+	return size;
+}
+
+/* send a cache entry to the client, without copying it. the caller must hold a
+ * reference to the entry, so that it can't be freed while it is being sent. */
+static void do_server_entry(struct request *rq, struct file_data *data, cache_ht_entry *entry)
+{
+	request_set_data(rq, entry->fileData);
+	request_sendfile(rq);
+	request_set_data(rq, data);
+}
+
+/* count the heap and arena allocations and the writes made by a request. the
+ * allocations are zero for a cache hit once the arena has grown to fit the request state */
+static void server_stats_add(struct server *sv, unsigned long mallocs, unsigned long allocs,
+							 unsigned long writes)
+{
+	__atomic_add_fetch(&sv->stats.requests, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sv->stats.heapAllocs, nr_mallocs - mallocs, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sv->stats.arenaAllocs, Arena.nr_allocs - allocs, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sv->stats.writes, nr_writes - writes, __ATOMIC_RELAXED);
+}
+
+/* add a record of a request to the access log. start and parsed are the stage_clock() times
+ * at which the request was accepted and parsed. */
+static void do_server_log(struct server *sv, struct request *rq, struct file_data *data,
+						  int result, uint64_t start, uint64_t parsed)
+{
+	const struct request_info *info = request_get_info(rq);
+	struct access_record rec;
+	uint64_t total = stage_ns(stage_clock() - start);
+
+#define SATURATE(ns) ((ns) > UINT32_MAX ? UINT32_MAX : (uint32_t)(ns))
+	rec.time = access_log_time() - total;
+	rec.total_ns = SATURATE(total);
+	rec.parse_ns = SATURATE(stage_ns(parsed - start));
+	rec.read_ns = SATURATE(info->read_ns);
+	rec.process_ns = SATURATE(info->process_ns);
+	rec.send_ns = SATURATE(info->send_ns);
+#undef SATURATE
+	rec.length = info->length;
+	rec.status = info->status;
+	rec.result = result;
+	rec.pad = 0;
+	strncpy(rec.file, data->file_name, ACCESS_FILE_LEN - 1);
+	rec.file[ACCESS_FILE_LEN - 1] = '\0';
+	access_log_write(sv->log, &rec);
+}
+
+/* give this thread statistics, on the list of the server */
+static void thread_stats_register(struct server *sv)
+{
+	ThreadStats = (thread_stats *)Malloc(sizeof(thread_stats));
+	memset(ThreadStats, 0, sizeof(thread_stats));
+	pthread_mutex_lock(&H_LOCK);
+	ThreadStats->next = sv->threadStats;
+	sv->threadStats = ThreadStats;
+	pthread_mutex_unlock(&H_LOCK);
+}
+
+/* record a request, started at stage_clock() time start, how it was served, and the bytes
+ * sent */
+static void thread_stats_record(int result, uint64_t start, int bytes)
+{
+	uint64_t service = stage_ns(stage_clock() - start);
+	histogram_record(&ThreadStats->hist[LATENCY_SERVICE], service);
+	if (result == ACCESS_HIT || result == ACCESS_L1_HIT)
+		histogram_record(&ThreadStats->hist[LATENCY_HIT], service);
+	else if (result == ACCESS_MISS)
+		histogram_record(&ThreadStats->hist[LATENCY_MISS], service);
+	STATS_ADD(ThreadStats->results[result], 1);
+	STATS_ADD(ThreadStats->bytes, bytes);
+}
+
+/* is the request for METRICS_PATH, however the client spelled it */
+static int do_server_is_metrics(struct file_data *data)
+{
+	char name[MAXLINE];
+
+	if (strstr(data->file_name, METRICS_PATH) == NULL)
+		return 0;
+	fd_cache_normalize(data->file_name, name, sizeof(name));
+	return strcmp(name, METRICS_PATH) == 0;
+}
+
+/* the upper bounds of the buckets of the latency histograms in the metrics, in seconds */
+static const double metricsBuckets[] = {0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+										0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5,
+										5, 10};
+
+/* write h, in ns, as a Prometheus histogram in seconds. labels is empty, or a label list
+ * ending in a comma */
+static void metrics_histogram(FILE *f, const char *name, const char *labels,
+							  const struct histogram *h)
+{
+	uint64_t count = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		count += h->buckets[i]; // rather than h->count, so that +Inf matches the buckets
+	for (unsigned i = 0; i < sizeof(metricsBuckets) / sizeof(metricsBuckets[0]); i++)
+	{
+		fprintf(f, "%s_bucket{%sle=\"%g\"} %lu\n", name, labels, metricsBuckets[i],
+				(unsigned long)histogram_count_below(h, metricsBuckets[i] * 1e9));
+	}
+	fprintf(f, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, labels, (unsigned long)count);
+	if (*labels != '\0')
+	{ // without the trailing comma
+		fprintf(f, "%s_sum{%.*s} %.9f\n", name, (int)strlen(labels) - 1, labels, h->sum / 1e9);
+		fprintf(f, "%s_count{%.*s} %lu\n", name, (int)strlen(labels) - 1, labels,
+				(unsigned long)count);
+	}
+	else
+	{
+		fprintf(f, "%s_sum %.9f\n", name, h->sum / 1e9);
+		fprintf(f, "%s_count %lu\n", name, (unsigned long)count);
+	}
+}
+
+#define METRIC(f, name, type, help) fprintf(f, "# HELP " name " " help "\n# TYPE " name " " type "\n")
+
+/* answer the request with the metrics of the server, in the Prometheus text format. the
+ * counters of every thread are added up while the threads keep serving requests, so they
+ * may be a request or two apart from each other. */
+static void do_server_metrics(struct server *sv, struct request *rq)
+{
+	struct histogram *merged = (struct histogram *)Malloc(sizeof(struct histogram) * LATENCY_NR);
+	unsigned long results[ACCESS_NR] = {0}, bytes = 0;
+	int busy = 0, queued;
+	// counted after the results, so read before them
+	unsigned long blockHits = __atomic_load_n(&sv->stats.blockHits, __ATOMIC_ACQUIRE);
+	memset(merged, 0, sizeof(struct histogram) * LATENCY_NR);
+	pthread_mutex_lock(&H_LOCK);
+	for (thread_stats *t = sv->threadStats; t != NULL; t = t->next)
+	{
+		for (int i = 0; i < LATENCY_NR; i++)
+			histogram_merge(&merged[i], &t->hist[i]);
+		for (int i = 0; i < ACCESS_NR; i++)
+			results[i] += __atomic_load_n(&t->results[i], __ATOMIC_RELAXED);
+		bytes += __atomic_load_n(&t->bytes, __ATOMIC_RELAXED);
+		busy += __atomic_load_n(&t->busy, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&H_LOCK);
+
+	char *body = NULL;
+	size_t length = 0;
+	FILE *f = open_memstream(&body, &length);
+	if (f == NULL)
+		unix_error("open_memstream");
+	METRIC(f, "oswebserver_requests_total", "counter", "Requests served, by how they were served.");
+	for (int i = 0; i < ACCESS_NR; i++)
+	{
+		fprintf(f, "oswebserver_requests_total{result=\"%s\"} %lu\n", access_result_name(i),
+				results[i]);
+	}
+	METRIC(f, "oswebserver_response_bytes_total", "counter", "Body bytes sent.");
+	fprintf(f, "oswebserver_response_bytes_total %lu\n", bytes);
+	if (sv->cache != NULL || sv->shm != NULL)
+	{ // the cache lock is only held for the reads
+		int size, maxSize, entries;
+		unsigned long evictions;
+		if (sv->shm != NULL)
+		{ // shared by the worker processes, unlike the requests counted here
+			struct shm_cache_stats stats;
+			shm_cache_get_stats(sv->shm, &stats);
+			size = stats.size;
+			maxSize = stats.max_size;
+			entries = stats.entries;
+			evictions = stats.evictions;
+		}
+		else
+		{
+			lock_acquire(&C_LOCK);
+			size = sv->cache->curSize;
+			entries = sv->cache->nrEntries;
+			evictions = sv->cache->evictions;
+			lock_release(&C_LOCK);
+			maxSize = sv->cache->maxSize;
+		}
+		if (blockHits > results[ACCESS_BLOCKS])
+			blockHits = results[ACCESS_BLOCKS];
+		METRIC(f, "oswebserver_cache_hits_total", "counter",
+			   "Requests served from the cache, including ranges whose blocks all were.");
+		fprintf(f, "oswebserver_cache_hits_total %lu\n",
+				results[ACCESS_HIT] + results[ACCESS_L1_HIT] + blockHits);
+		METRIC(f, "oswebserver_cache_misses_total", "counter", "Requests read into the cache.");
+		fprintf(f, "oswebserver_cache_misses_total %lu\n",
+				results[ACCESS_MISS] + results[ACCESS_BLOCKS] - blockHits);
+		METRIC(f, "oswebserver_cache_evictions_total", "counter", "Files evicted from the cache.");
+		fprintf(f, "oswebserver_cache_evictions_total %lu\n", evictions);
+		METRIC(f, "oswebserver_cache_bytes", "gauge", "Bytes of files in the cache.");
+		fprintf(f, "oswebserver_cache_bytes %d\n", size);
+		METRIC(f, "oswebserver_cache_capacity_bytes", "gauge", "Size of the cache.");
+		fprintf(f, "oswebserver_cache_capacity_bytes %d\n", maxSize);
+		METRIC(f, "oswebserver_cache_entries", "gauge", "Files in the cache.");
+		fprintf(f, "oswebserver_cache_entries %d\n", entries);
+	}
+	if (sv->nr_threads > 0)
+	{
+		lock_acquire(&B_LOCK);
+		queued = (B_IN - B_OUT + sv->max_requests) % sv->max_requests;
+		lock_release(&B_LOCK);
+		METRIC(f, "oswebserver_queue_depth", "gauge", "Requests waiting for a worker thread.");
+		fprintf(f, "oswebserver_queue_depth %d\n", queued);
+		METRIC(f, "oswebserver_queue_capacity", "gauge", "Requests that can wait at once.");
+		fprintf(f, "oswebserver_queue_capacity %d\n", sv->max_requests - 1);
+	}
+	METRIC(f, "oswebserver_workers_active", "gauge", "Threads serving a request, this one included.");
+	fprintf(f, "oswebserver_workers_active %d\n", busy);
+	METRIC(f, "oswebserver_workers", "gauge", "Threads serving requests.");
+	fprintf(f, "oswebserver_workers %d\n", sv->nr_threads > 0 ? sv->nr_threads : 1);
+	if (sv->watchdog != NULL)
+	{
+		METRIC(f, "oswebserver_stuck_requests_total", "counter",
+			   "Requests the watchdog found a worker thread stuck on.");
+		fprintf(f, "oswebserver_stuck_requests_total %lu\n", watchdog_get_stuck(sv->watchdog));
+	}
+
+	struct request_conn_stats conns;
+	request_get_conn_stats(&conns);
+	METRIC(f, "oswebserver_connections_cut_total", "counter", "Connections given up on, by why.");
+	fprintf(f, "oswebserver_connections_cut_total{reason=\"idle\"} %lu\n", conns.idle);
+	fprintf(f, "oswebserver_connections_cut_total{reason=\"header\"} %lu\n", conns.header);
+	fprintf(f, "oswebserver_connections_cut_total{reason=\"write\"} %lu\n", conns.write);
+	fprintf(f, "oswebserver_connections_cut_total{reason=\"disconnected\"} %lu\n",
+			conns.disconnected);
+	fprintf(f, "oswebserver_connections_cut_total{reason=\"cancelled\"} %lu\n", conns.cancelled);
+
+	METRIC(f, "oswebserver_request_duration_seconds", "histogram",
+		   "Time from when a worker takes a request until it is done with it.");
+	metrics_histogram(f, "oswebserver_request_duration_seconds", "", &merged[LATENCY_SERVICE]);
+	METRIC(f, "oswebserver_cache_request_duration_seconds", "histogram",
+		   "The same, for requests served from or read into the cache.");
+	metrics_histogram(f, "oswebserver_cache_request_duration_seconds", "cache=\"hit\",",
+					  &merged[LATENCY_HIT]);
+	metrics_histogram(f, "oswebserver_cache_request_duration_seconds", "cache=\"miss\",",
+					  &merged[LATENCY_MISS]);
+	METRIC(f, "oswebserver_queue_wait_seconds", "histogram",
+		   "Time from when a request is accepted until a worker takes it.");
+	metrics_histogram(f, "oswebserver_queue_wait_seconds", "", &merged[LATENCY_QUEUE]);
+	free(merged);
+
+#if STAGE_TIMERS
+	uint64_t ns[STAGE_NR], count[STAGE_NR];
+	stage_get_totals(ns, count);
+	METRIC(f, "oswebserver_stage_seconds_total", "counter", "Time spent in each stage of requests.");
+	for (int i = 0; i < STAGE_NR; i++)
+	{
+		fprintf(f, "oswebserver_stage_seconds_total{stage=\"%s\"} %.9f\n", stage_name(i),
+				ns[i] / 1e9);
+	}
+	METRIC(f, "oswebserver_stage_total", "counter", "Times each stage of requests was timed.");
+	for (int i = 0; i < STAGE_NR; i++)
+	{
+		fprintf(f, "oswebserver_stage_total{stage=\"%s\"} %lu\n", stage_name(i),
+				(unsigned long)count[i]);
+	}
+#endif
+
+	struct lock_stats b, c;
+	if (lock_get_stats(&B_LOCK, &b) && lock_get_stats(&C_LOCK, &c))
+	{ // built with -DLOCK_STATS
+		METRIC(f, "oswebserver_lock_acquired_total", "counter", "Times each lock was taken.");
+		fprintf(f, "oswebserver_lock_acquired_total{lock=\"buffer\"} %lu\n", b.acquired);
+		fprintf(f, "oswebserver_lock_acquired_total{lock=\"cache\"} %lu\n", c.acquired);
+		METRIC(f, "oswebserver_lock_contended_total", "counter", "Times a thread waited for each lock.");
+		fprintf(f, "oswebserver_lock_contended_total{lock=\"buffer\"} %lu\n", b.contended);
+		fprintf(f, "oswebserver_lock_contended_total{lock=\"cache\"} %lu\n", c.contended);
+		METRIC(f, "oswebserver_lock_wait_seconds_total", "counter", "Time spent waiting for each lock.");
+		fprintf(f, "oswebserver_lock_wait_seconds_total{lock=\"buffer\"} %.9f\n", b.wait_ns / 1e9);
+		fprintf(f, "oswebserver_lock_wait_seconds_total{lock=\"cache\"} %.9f\n", c.wait_ns / 1e9);
+	}
+	fclose(f);
+	request_send_text(rq, "text/plain; version=0.0.4", body, length);
+	free(body);
+}
+
+/* serve the request on connfd. accepted is the stage_clock() time at which it was queued
+ * for a worker thread, or 0 if it wasn't */
+static void do_server_request(struct server *sv, int connfd, uint64_t accepted)
+{
+	int ret, first, last, result = ACCESS_NOCACHE;
 	struct request *rq;
-	struct file_data *data = file_data_init();
+	unsigned long mallocs = nr_mallocs, allocs = Arena.nr_allocs, writes = nr_writes;
+	uint64_t start = stage_clock(), parsed;
+	struct file_data *data = arena_alloc(&Arena, sizeof(struct file_data));
 
+	if (ThreadStats == NULL)
+		thread_stats_register(sv);
+	STATS_SET(ThreadStats->busy, 1);
+	watchdog_begin(sv->watchdog, connfd, start); // request_destroy() ends it
+	if (accepted != 0)
+	{
+		uint64_t wait = stage_ns(start - accepted);
+		PROBE(dequeue, connfd, wait);
+		stage_add(STAGE_QUEUE, start - accepted);
+		histogram_record(&ThreadStats->hist[LATENCY_QUEUE], wait);
+	}
 	/* fill data->file_name with name of the file being requested */
-	rq = request_init(connfd, data);
+	rq = request_init(connfd, data, &Arena);
 	if (!rq)
 	{
-		file_data_free(data);
-		return;
+		goto done;
+	}
+	parsed = stage_clock();
+	stage_add(STAGE_PARSE, parsed - start);
+	watchdog_file(data->file_name);
+	if (do_server_is_metrics(data))
+	{ // before the name is looked up anywhere
+		result = ACCESS_METRICS;
+		do_server_metrics(sv, rq);
+		goto out;
+	}
+	if (sv->archive != NULL)
+	{ // every file is in the mapped archive
+		result = ACCESS_ARCHIVE;
+		if (request_readfile(rq))
+			request_sendfile(rq);
+		data->file_buf = NULL; // points into the archive
 	}
-	if (sv->max_cache_size == 0)
+	else if (sv->shm != NULL)
+	{ // cache shared between worker processes
+		result = do_server_shm(sv, rq, data);
+	}
+	else if (sv->max_cache_size == 0)
 	{ // no cache
 		/* read file, 
 		* fills data->file_buf with the file contents,
@@ -153,55 +733,174 @@ static void do_server_request(struct server *sv, int connfd)
 	}
 	else
 	{ // use cache
-		cache_ht_entry *search = NULL;
-		pthread_mutex_lock(&C_LOCK);
+		if (sv->prefetch != NULL)
+			prefetch_record(sv->prefetch, data->file_name);
+		watchdog_stage(STAGE_LOOKUP);
+		uint64_t lookup = stage_begin();
+		cache_ht_entry *search = l1_lookup(data->file_name);
+		if (search != NULL)
+		{ // file data exists in this thread's l1 cache, which holds a reference to it
+			stage_end(STAGE_LOOKUP, lookup);
+			PROBE(cache_hit, data->file_name, search->fileData->file_size, 1);
+			result = ACCESS_L1_HIT;
+			do_server_entry(rq, data, search);
+			goto out;
+		}
+		epoch_enter();
 		search = cache_lookup(sv->cache, data->file_name);
+		if (search != NULL && !cache_entry_get(search))
+			search = NULL; // evicted after we found it
+		epoch_exit();
+		stage_end(STAGE_LOOKUP, lookup);
 		if (search != NULL)
 		{ // file data exists in cache
-			search->inUse++;
-			data->file_size = search->fileData->file_size;
-			data->file_buf = strdup(search->fileData->file_buf);
-			request_set_data(rq, data);
-			lru_list_move_to_head(sv->cache->lruOrder, data);
+			if (__atomic_load_n(&search->prefetched, __ATOMIC_RELAXED) &&
+				__atomic_exchange_n(&search->prefetched, 0, __ATOMIC_RELAXED))
+				__atomic_add_fetch(&sv->stats.prefetchHits, 1, __ATOMIC_RELAXED);
+			PROBE(cache_hit, data->file_name, search->fileData->file_size, 0);
+			result = ACCESS_HIT;
+			l1_insert(search);
+			do_server_entry(rq, data, search);
+			cache_entry_put(search);
+			goto out;
 		}
 		else
 		{ // file data does not exist in cache
-			pthread_mutex_unlock(&C_LOCK);
+			PROBE(cache_miss, data->file_name);
+			result = ACCESS_MISS;
+			ret = request_statfile(rq);
+			if (ret == 0)
+			{ /* couldn't find file */
+				goto out;
+			}
+			if (data->file_size > sv->cache->maxSize) // the same ETag as its ranges, which aren't read whole
+				request_use_mtime_etag(rq);
+			if (data->file_size > sv->cache->maxSize && !request_process_replaces() &&
+				request_get_range(rq, &first, &last) != 0)
+			{ // range of a file too large to cache whole, sent as it is
+				result = ACCESS_BLOCKS;
+				do_server_blocks(sv, rq, data);
+				goto out;
+			}
 			ret = request_readfile(rq);
 			if (ret == 0)
 			{ /* couldn't read file */
 				goto out;
 			}
-			pthread_mutex_lock(&C_LOCK);
-			search = cache_insert(sv->cache, data);
-			if (search != NULL)
-			{
-				search->inUse++;
-				lru_list_move_to_head(sv->cache->lruOrder, data);
-			}
+			if (!request_not_modified(rq))
+				request_processfile(rq); // so that the result is cached with the file
+			lock_acquire(&C_LOCK);
+			cache_insert(sv->cache, data);
+			lock_release(&C_LOCK);
 		}
-		pthread_mutex_unlock(&C_LOCK);
 		request_sendfile(rq);
-		if (search != NULL)
-			search->inUse--;
 	}
 out:
+	if (sv->log != NULL)
+		do_server_log(sv, rq, data, result, start, parsed);
+	thread_stats_record(result, start, request_get_info(rq)->length);
+	if (result == ACCESS_BLOCKS && request_get_info(rq)->read_ns == 0) // every block was cached
+		__atomic_add_fetch(&sv->stats.blockHits, 1, __ATOMIC_RELEASE);
 	request_destroy(rq);
-	file_data_free(data);
+done:
+	STATS_SET(ThreadStats->busy, 0);
+	free(data->file_buf); // everything else is in the arena
+	request_free_result(data->file_result);
+	arena_reset(&Arena);
+	server_stats_add(sv, mallocs, allocs, writes);
 	return;
 }
 
+void server_opts_init(struct server_opts *opts)
+{
+	opts->shm_cache = NULL;
+	opts->max_fds = FD_CACHE_SIZE;
+	opts->storage = NULL;
+	opts->prefetch_bw = 0;
+	opts->access_log = NULL;
+	opts->idle_timeout = 10000;
+	opts->header_timeout = 10000;
+	opts->write_timeout = 60000;
+	opts->doc_index = NULL;
+	opts->archive = NULL;
+	opts->watchdog_ms = 0;
+	opts->watchdog_close = 0;
+}
+
 struct server *server_init(int nr_threads, int max_requests, int max_cache_size)
 {
-	pthread_mutex_lock(&B_LOCK);
+	struct server_opts opts;
+	server_opts_init(&opts);
+	return server_init_opts(nr_threads, max_requests, max_cache_size, &opts);
+}
+
+struct server *server_init_opts(int nr_threads, int max_requests, int max_cache_size,
+				const struct server_opts *opts)
+{
+	stage_calibrate(); // before any lock or stage is timed
+	lock_acquire(&B_LOCK);
 	struct server *sv = (struct server *)Malloc(sizeof(struct server));
 	sv->nr_threads = nr_threads;
 	sv->max_requests = max_requests + 1;
 	sv->max_cache_size = max_cache_size;
 	sv->exiting = 0;
+	memset(&sv->stats, 0, sizeof(sv->stats));
 	sv->worker_thread = NULL;
 	sv->request_buff = NULL;
+	sv->request_time = NULL;
+	sv->threadStats = NULL;
 	sv->cache = NULL;
+	sv->prefetch = NULL;
+	sv->watchdog = NULL;
+	if (opts->watchdog_ms > 0)
+		sv->watchdog = watchdog_create(opts->watchdog_ms, opts->watchdog_close);
+	sv->log = NULL;
+	if (opts->access_log != NULL)
+	{ // created here, as the log thread doesn't survive a fork
+		sv->log = access_log_create(opts->access_log);
+		if (sv->log == NULL)
+		{
+			perror(opts->access_log);
+			exit(1);
+		}
+	}
+	sv->shm = opts->shm_cache;
+	sv->fds = NULL;
+	if (opts->max_fds > 0)
+	{ // the server serves files from its current directory
+		sv->fds = fd_cache_create(".", opts->max_fds);
+	}
+	request_set_fd_cache(sv->fds);
+	sv->storage = opts->storage;
+	sv->own_storage = 0;
+	if (sv->storage == NULL)
+	{
+		sv->storage = storage_create("sim");
+		sv->own_storage = 1;
+	}
+	request_set_storage(sv->storage);
+	request_set_timeouts(opts->idle_timeout, opts->header_timeout, opts->write_timeout);
+	sv->archive = NULL;
+	if (opts->archive != NULL)
+	{ // the archive is already in memory, so it is served without a cache
+		sv->archive = archive_open(opts->archive);
+		if (sv->archive == NULL)
+		{
+			perror(opts->archive);
+			exit(1);
+		}
+	}
+	request_set_archive(sv->archive);
+	sv->docIndex = opts->doc_index;
+	pthread_mutex_init(&sv->reloadLock, NULL);
+	sv->reloading = 0;
+	sv->reloadStarted = 0;
+	sv->reloadAgain = 0;
+	if (sv->docIndex != NULL && request_load_index(sv->docIndex) < 0)
+	{
+		perror(sv->docIndex);
+		exit(1);
+	}
 
 	if (nr_threads > 0 || max_requests > 0 || max_cache_size > 0)
 	{
@@ -209,11 +908,14 @@ struct server *server_init(int nr_threads, int max_requests, int max_cache_size)
 		if (max_requests > 0)
 		{
 			sv->request_buff = (int *)Malloc(sizeof(int) * (max_requests + 1));
+			sv->request_time = (uint64_t *)Malloc(sizeof(uint64_t) * (max_requests + 1));
 		}
 		// Lab 5: init server cache and limit its size to max_cache_size
-		if (max_cache_size > 0)
+		if (max_cache_size > 0 && sv->shm == NULL && sv->archive == NULL)
 		{
 			sv->cache = cache_init(max_cache_size);
+			if (opts->prefetch_bw > 0)
+				sv->prefetch = prefetch_create(opts->prefetch_bw, do_server_prefetch, sv);
 		}
 		// create worker threads, if nr_threads > 0
 		if (nr_threads > 0)
@@ -227,7 +929,7 @@ struct server *server_init(int nr_threads, int max_requests, int max_cache_size)
 		}
 	}
 
-	pthread_mutex_unlock(&B_LOCK);
+	lock_release(&B_LOCK);
 	return sv;
 }
 
@@ -236,28 +938,100 @@ void server_request(struct server *sv, int connfd)
 {
 	if (sv->nr_threads == 0)
 	{ /* no worker threads */
-		do_server_request(sv, connfd);
+		do_server_request(sv, connfd, 0);
 	}
 	else
 	{
 		/*  Save the relevant info in a buffer and have one of the
 		 *  worker threads do the work. */
-		pthread_mutex_lock(&B_LOCK);
+		uint64_t accepted = stage_clock(); // the wait for a free slot is queueing too
+		lock_acquire(&B_LOCK);
 		while ((B_IN - B_OUT + sv->max_requests) % sv->max_requests == sv->max_requests - 1 && sv->exiting == 0)
 		{
-			pthread_cond_wait(&B_FULL, &B_LOCK);
+			lock_wait(&B_FULL, &B_LOCK);
 		}
+		PROBE(accept, connfd, (B_IN - B_OUT + sv->max_requests) % sv->max_requests);
 		sv->request_buff[B_IN] = connfd;
+		sv->request_time[B_IN] = accepted;
 		if (B_IN == B_OUT)
 		{
-			pthread_cond_broadcast(&B_EMPTY);
+			lock_broadcast(&B_EMPTY, &B_LOCK);
 		}
 		B_IN = (B_IN + 1) % sv->max_requests;
-		pthread_mutex_unlock(&B_LOCK);
+		lock_release(&B_LOCK);
 	}
 	return;
 }
 
+/* rebuild the index, and once more for every reload requested meanwhile, in
+ * case the requests were for changes it missed */
+static void *server_reload_thread(void *arg)
+{
+	struct server *sv = (struct server *)arg;
+	while (1)
+	{
+		int n = request_load_index(sv->docIndex);
+		if (n < 0) // keep serving the old index
+			perror(sv->docIndex);
+		else
+			fprintf(stderr, "index: %d files\n", n);
+		pthread_mutex_lock(&sv->reloadLock);
+		if (!sv->reloadAgain)
+		{
+			sv->reloading = 0;
+			pthread_mutex_unlock(&sv->reloadLock);
+			return NULL;
+		}
+		sv->reloadAgain = 0;
+		pthread_mutex_unlock(&sv->reloadLock);
+	}
+}
+
+void server_reload(struct server *sv)
+{
+	if (sv->docIndex == NULL)
+		return;
+	pthread_mutex_lock(&sv->reloadLock);
+	if (sv->reloading)
+	{ // the thread that is rebuilding it will go again
+		sv->reloadAgain = 1;
+		pthread_mutex_unlock(&sv->reloadLock);
+		return;
+	}
+	if (sv->reloadStarted) // done, or about to return
+		pthread_join(sv->reloadThread, NULL);
+	sv->reloading = 1;
+	sv->reloadStarted = 1;
+	if ((errno = pthread_create(&sv->reloadThread, NULL, server_reload_thread, sv)))
+		unix_error("server_reload: pthread_create");
+	pthread_mutex_unlock(&sv->reloadLock);
+}
+
+void server_report(struct server *sv)
+{
+	struct histogram *merged = (struct histogram *)Malloc(sizeof(struct histogram) * LATENCY_NR);
+	memset(merged, 0, sizeof(struct histogram) * LATENCY_NR);
+	pthread_mutex_lock(&H_LOCK);
+	for (thread_stats *t = sv->threadStats; t != NULL; t = t->next)
+	{ // the other threads keep recording while their histograms are read
+		for (int i = 0; i < LATENCY_NR; i++)
+			histogram_merge(&merged[i], &t->hist[i]);
+	}
+	pthread_mutex_unlock(&H_LOCK);
+	for (int i = 0; i < LATENCY_NR; i++)
+	{
+		char name[32];
+		if (merged[i].count == 0)
+			continue;
+		snprintf(name, sizeof(name), "latency %s", latencyNames[i]);
+		histogram_print(stderr, name, &merged[i]);
+	}
+	free(merged);
+	stage_report(stderr);
+	lock_print(stderr, &B_LOCK);
+	lock_print(stderr, &C_LOCK);
+}
+
 void server_exit(struct server *sv)
 {
 	/* when using one or more worker threads, use sv->exiting to indicate to
@@ -270,13 +1044,66 @@ void server_exit(struct server *sv)
 	{
 		pthread_join(*sv->worker_thread[i], NULL);
 	}
+	if (sv->nr_threads == 0)
+	{ // requests were served by this thread
+		l1_release();
+		arena_destroy(&Arena);
+	}
+	if (sv->stats.requests > 0)
+	{
+		fprintf(stderr, "server: %lu requests, %.2f heap allocations, %.2f arena "
+				"allocations and %.2f writes per request\n", sv->stats.requests,
+				(double)sv->stats.heapAllocs / sv->stats.requests,
+				(double)sv->stats.arenaAllocs / sv->stats.requests,
+				(double)sv->stats.writes / sv->stats.requests);
+	}
+	struct request_conn_stats conns;
+	request_get_conn_stats(&conns);
+	if (conns.idle + conns.header + conns.write + conns.disconnected + conns.cancelled > 0)
+	{
+		fprintf(stderr, "connections: %lu idle, %lu header and %lu write timeouts, "
+				"%lu disconnected, %lu cancelled\n", conns.idle, conns.header,
+				conns.write, conns.disconnected, conns.cancelled);
+	}
+	if (sv->prefetch != NULL)
+	{
+		struct prefetch_stats stats;
+		prefetch_get_stats(sv->prefetch, &stats);
+		prefetch_destroy(sv->prefetch); // before the cache it fills goes away
+		fprintf(stderr, "prefetch: %lu issued, %lu loaded, %lu dropped, %lu hits, %lu wasted\n",
+				stats.issued, stats.loaded, stats.dropped, sv->stats.prefetchHits,
+				sv->cache->prefetchWasted);
+	}
+	server_report(sv);
+	watchdog_destroy(sv->watchdog); // no thread is on a request anymore
 	/* make sure to free any allocated resources */
 	for (unsigned i = 0; i < sv->nr_threads; i++)
 	{
 		free(sv->worker_thread[i]);
 	}
+	while (sv->threadStats != NULL)
+	{ // the worker threads are done, and this one won't serve requests again
+		thread_stats *next = sv->threadStats->next;
+		free(sv->threadStats);
+		sv->threadStats = next;
+	}
+	ThreadStats = NULL;
+	stage_exit();
+	access_log_destroy(sv->log); // all requests are done
 	cache_destroy(sv->cache);
+	if (sv->reloadStarted) // the index it is building is unloaded next
+		pthread_join(sv->reloadThread, NULL);
+	pthread_mutex_destroy(&sv->reloadLock);
+	request_unload_index();
+	request_set_archive(NULL);
+	archive_close(sv->archive);
+	request_set_fd_cache(NULL);
+	fd_cache_destroy(sv->fds);
+	request_set_storage(NULL);
+	if (sv->own_storage)
+		storage_destroy(sv->storage);
 	free(sv->request_buff);
+	free(sv->request_time);
 	free(sv->worker_thread);
 	free(sv);
 	return;
@@ -288,23 +1115,27 @@ void worker_thread(struct server *sv)
 {
 	while (1)
 	{
-		pthread_mutex_lock(&B_LOCK);
+		lock_acquire(&B_LOCK);
 		while (B_IN == B_OUT && sv->exiting == 0)
 		{
-			pthread_cond_wait(&B_EMPTY, &B_LOCK);
+			lock_wait(&B_EMPTY, &B_LOCK);
 		}
 		int connfd = sv->request_buff[B_OUT];
+		uint64_t accepted = sv->request_time[B_OUT];
 		if ((B_IN - B_OUT + sv->max_requests) % sv->max_requests == sv->max_requests - 1)
 		{
-			pthread_cond_signal(&B_FULL);
+			lock_signal(&B_FULL, &B_LOCK);
 		}
 		B_OUT = (B_OUT + 1) % (sv->max_requests);
-		pthread_mutex_unlock(&B_LOCK);
+		lock_release(&B_LOCK);
 		if (sv->exiting == 1)
 		{
+			l1_release();
+			arena_destroy(&Arena);
+			epoch_thread_exit();
 			pthread_exit(NULL);
 		}
-		do_server_request(sv, connfd);
+		do_server_request(sv, connfd, accepted);
 	}
 	return;
 }
@@ -318,7 +1149,15 @@ struct server_cache *cache_init(int maxSize)
 	cache->maxSize = maxSize;
 	cache->maxTableSize = CACHE_TABLE_SIZE;
 	cache->curSize = 0;
-	cache->lruOrder = lru_list_init();
+	cache->blockSize = maxSize / 4;
+	if (cache->blockSize > CACHE_BLOCK_SIZE)
+		cache->blockSize = CACHE_BLOCK_SIZE;
+	if (cache->blockSize < CACHE_MIN_BLOCK_SIZE)
+		cache->blockSize = CACHE_MIN_BLOCK_SIZE;
+	cache->nrEntries = 0;
+	cache->clockHand = NULL;
+	cache->prefetchWasted = 0;
+	cache->evictions = 0;
 	cache->hashTable = cache_ht_init();
 	return cache;
 }
@@ -328,8 +1167,8 @@ void cache_destroy(server_cache *cache)
 {
 	if (cache != NULL)
 	{
-		lru_list_destroy(cache->lruOrder);
 		cache_ht_destroy(cache->hashTable);
+		epoch_drain(); // all threads are done with the evicted entries
 		free(cache);
 	}
 	return;
@@ -339,54 +1178,108 @@ cache_ht_entry *cache_insert(server_cache *cache, struct file_data *fileData)
 {
 	if (fileData->file_size > cache->maxSize)
 		return NULL;
-	cache_ht_entry *search = cache_lookup(cache, fileData->file_name);
+	cache_ht_entry *search = cache_ht_search(cache->hashTable, fileData->file_name);
 	if (search != NULL)
 		return NULL;
 	int evict = cache_evict(cache, fileData->file_size);
 	if (evict == 0)
 		return NULL;
 	cache->curSize = cache->curSize + fileData->file_size;
-	lru_list_insert_at_first(cache->lruOrder, fileData);
 	cache_ht_entry *ret = cache_ht_insert(cache->hashTable, fileData);
+	cache_clock_insert(cache, ret);
 	return ret;
 }
 
+/* called without C_LOCK, in an epoch. the entry may be evicted as soon as the epoch is left,
+ * unless a reference is taken with cache_entry_get(). */
 cache_ht_entry *cache_lookup(server_cache *cache, char *fileName)
 {
-	return cache_ht_search(cache->hashTable, fileName);
+	cache_ht_entry *entry = cache_ht_search(cache->hashTable, fileName);
+	// only write the shared access bit when it changes
+	if (entry != NULL && !__atomic_load_n(&entry->accessed, __ATOMIC_RELAXED))
+		__atomic_store_n(&entry->accessed, 1, __ATOMIC_RELAXED);
+	return entry;
 }
 
+/* make room for size bytes, returns 0 if that is not possible. entries are considered in
+ * clock order: recently accessed entries and entries in use get a second chance. */
 int cache_evict(server_cache *cache, int size)
 {
-	if (cache->maxSize - cache->curSize < size)
+	int steps = 0;
+	while (cache->maxSize - cache->curSize < size)
 	{
-		int avaliableSize = cache->maxSize - cache->curSize;
-		while (avaliableSize < size)
-		{ // make sure there is enough space to evict
-			lru_node *tail = cache->lruOrder->tail;
-			if (tail == NULL) // empty lru list
-				break;
-			cache_ht_entry *tailFileData = cache_lookup(cache, tail->fileName);
-			if (tailFileData->inUse > 0) // file data in use
-				break;
-			avaliableSize = avaliableSize + tailFileData->fileData->file_size;
-			cache->curSize -= tailFileData->fileData->file_size;
-			lru_list_remove_last(cache->lruOrder);
-			cache_ht_delete(cache->hashTable, tailFileData->fileData);
+		cache_ht_entry *victim = cache->clockHand;
+		if (victim == NULL) // empty cache
+			return 0;
+		cache->clockHand = victim->clockNext;
+		if (steps++ < 3 * cache->nrEntries)
+		{ // after that, every entry has had its second chance
+			if (__atomic_load_n(&victim->accessed, __ATOMIC_RELAXED))
+			{
+				__atomic_store_n(&victim->accessed, 0, __ATOMIC_RELAXED);
+				continue;
+			}
+			if (__atomic_load_n(&victim->inUse, __ATOMIC_RELAXED) > 1)
+				continue; // most likely held by an l1 cache because it is hot
 		}
+		// entries still in use are only unlinked here, and the l1 caches notice that they were evicted
+		if (__atomic_load_n(&victim->prefetched, __ATOMIC_RELAXED))
+			cache->prefetchWasted++;
+		PROBE(cache_evict, victim->fileData->file_name, victim->fileData->file_size,
+			  __atomic_load_n(&victim->inUse, __ATOMIC_RELAXED) - 1);
+		cache->curSize -= victim->fileData->file_size;
+		cache->evictions++;
+		cache_clock_remove(cache, victim);
+		cache_ht_delete(cache->hashTable, victim->fileData);
 	}
 	return 1;
 }
 
+/* add an entry just behind the clock hand, so that it is considered last */
+static void cache_clock_insert(server_cache *cache, cache_ht_entry *entry)
+{
+	cache_ht_entry *hand = cache->clockHand;
+	if (hand == NULL)
+	{
+		entry->clockNext = entry;
+		entry->clockPrev = entry;
+		cache->clockHand = entry;
+	}
+	else
+	{
+		entry->clockNext = hand;
+		entry->clockPrev = hand->clockPrev;
+		hand->clockPrev->clockNext = entry;
+		hand->clockPrev = entry;
+	}
+	cache->nrEntries++;
+}
+
+static void cache_clock_remove(server_cache *cache, cache_ht_entry *entry)
+{
+	if (entry->clockNext == entry)
+	{ // last entry
+		cache->clockHand = NULL;
+	}
+	else
+	{
+		entry->clockPrev->clockNext = entry->clockNext;
+		entry->clockNext->clockPrev = entry->clockPrev;
+		if (cache->clockHand == entry)
+			cache->clockHand = entry->clockNext;
+	}
+	cache->nrEntries--;
+}
 /* --------------------------------------------------------------------------------------- */
 
 /* hash function - djb2 - refer to http://www.cse.yorku.ca/~oz/hash.html */
 int djb2(char *key)
 {
-	int hash = 2 * strlen(key) + 1;
-	for (int i = 0; i < strlen(key); i++)
+	// unsigned, so that long keys don't overflow into a negative index
+	unsigned int hash = 2 * strlen(key) + 1;
+	for (int i = 0; key[i] != '\0'; i++)
 	{
-		hash = hash * 33 + (int)key[i];
+		hash = hash * 33 + (unsigned char)key[i];
 	}
 	return hash % CACHE_TABLE_SIZE;
 }
@@ -411,6 +1304,7 @@ void cache_ht_destroy(cache_hash_table *hashTable)
 		{
 			cache_ht_entry *temp = head[i];
 			head[i] = head[i]->next;
+			file_data_free(temp->fileData);
 			free(temp);
 		}
 	}
@@ -425,12 +1319,20 @@ cache_ht_entry *cache_ht_insert(cache_hash_table *hashTable, struct file_data *d
 	cache_ht_entry *temp = Malloc(sizeof(struct cache_ht_entry));
 	temp->fileData = file_data_init();
 	temp->fileData->file_size = data->file_size;
+	temp->fileData->file_csum = data->file_csum;
+	temp->fileData->file_mtime = data->file_mtime;
 	temp->fileData->file_name = strdup(data->file_name);
-	temp->fileData->file_buf = strdup(data->file_buf);
-	temp->inUse = 0;
+	temp->fileData->file_buf = file_buf_dup(data);
+	temp->fileData->file_result = file_result_dup(data);
+	temp->inUse = 1; // the cache's own reference
+	temp->evicted = 0;
+	temp->retired = 0;
+	temp->accessed = 0;
+	temp->prefetched = 0;
 	temp->next = head;
 	head = temp;
-	hashTable->head[index] = head;
+	// publish the entry to lookups only after it has been filled in
+	__atomic_store_n(&hashTable->head[index], head, __ATOMIC_RELEASE);
 	hashTable->tableSize++;
 	return temp;
 }
@@ -438,196 +1340,142 @@ cache_ht_entry *cache_ht_insert(cache_hash_table *hashTable, struct file_data *d
 cache_ht_entry *cache_ht_search(cache_hash_table *hashTable, char *fileName)
 {
 	int index = djb2(fileName);
-	cache_ht_entry *temp = hashTable->head[index];
+	cache_ht_entry *temp = __atomic_load_n(&hashTable->head[index], __ATOMIC_ACQUIRE);
 	while (temp != NULL)
 	{
 		if (strcmp(temp->fileData->file_name, fileName) == 0)
 		{
 			return temp;
 		}
-		temp = temp->next;
+		temp = __atomic_load_n(&temp->next, __ATOMIC_ACQUIRE);
 	}
 	return NULL;
 }
-
 int cache_ht_delete(cache_hash_table *hashTable, struct file_data *data)
 {
 	int index = djb2(data->file_name);
-	cache_ht_entry *head = hashTable->head[index];
-	if (head == NULL)
+	cache_ht_entry **prev = &hashTable->head[index];
+	while (*prev != NULL && strcmp((*prev)->fileData->file_name, data->file_name) != 0)
+		prev = &(*prev)->next;
+	if (*prev == NULL)
 		return 0;
-	if (strcmp(head->fileData->file_name, data->file_name) == 0)
+	cache_ht_entry *toDelete = *prev;
+	// lookups that already reached toDelete can still follow its next pointer
+	__atomic_store_n(prev, toDelete->next, __ATOMIC_RELEASE);
+	hashTable->tableSize--;
+	__atomic_store_n(&toDelete->evicted, 1, __ATOMIC_SEQ_CST);
+	// drop the cache's own reference, the entry is retired when the last one is dropped
+	cache_entry_put(toDelete);
+	return 1;
+}
+
+/* take a reference to an entry found by cache_lookup(), before leaving the epoch.
+ * returns 0 if the entry has been evicted in the meantime. */
+int cache_entry_get(cache_ht_entry *entry)
+{
+	__atomic_add_fetch(&entry->inUse, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&entry->evicted, __ATOMIC_SEQ_CST))
 	{
-		cache_ht_entry *toDelete = head;
-		head = head->next;
-		hashTable->head[index] = head;
-		file_data_free(toDelete->fileData);
-		free(toDelete);
-		hashTable->tableSize--;
-		return 1;
-	}
-	if (head->next == NULL)
+		cache_entry_put(entry);
 		return 0;
-	else
-	{
-		cache_ht_entry *temp = cache_ht_search(hashTable, data->file_name);
-		if (temp == NULL)
-			return 0;
-		cache_ht_entry *toDelete = temp->next;
-		temp->next = temp->next->next;
-		file_data_free(toDelete->fileData);
-		free(toDelete);
-		hashTable->tableSize--;
-		return 1;
 	}
+	return 1;
 }
 
-/* --------------------------------------------------------------------------------------- */
-
-lru_list *lru_list_init(void)
+/* drop a reference to a cache entry. the entry must not be touched after that, unless
+ * in an epoch: only the cache's own reference keeps it from being retired, and freed. */
+void cache_entry_put(cache_ht_entry *entry)
 {
-	lru_list *list = (lru_list *)Malloc(sizeof(lru_list));
-	list->listSize = 0;
-	list->head = NULL;
-	list->tail = NULL;
-	return list;
+	if (__atomic_sub_fetch(&entry->inUse, 1, __ATOMIC_SEQ_CST) == 0)
+		cache_entry_retire(entry);
 }
 
-void lru_list_destroy(lru_list *list)
+/* free an evicted entry once no lookup can see it anymore. a lookup that takes a reference
+ * just after the last one was dropped drops it again, but only one retires the entry. */
+static void cache_entry_retire(cache_ht_entry *entry)
 {
-	while (list->head != NULL)
-	{
-		lru_node *temp = list->head;
-		list->head = list->head->next;
-		free(temp);
-	}
-	free(list);
-	return;
+	if (__atomic_exchange_n(&entry->retired, 1, __ATOMIC_ACQ_REL) == 0)
+		epoch_retire(entry, cache_entry_free);
 }
 
-lru_node *lru_list_search(lru_list *list, struct file_data *file_data)
+static void cache_entry_free(void *entry)
 {
-	if (list == NULL || list->head == NULL)
-		return NULL;
-	else
-	{
-		lru_node *temp = list->head;
-		while (temp != NULL)
-		{
-			if (strcmp(temp->fileName, file_data->file_name) == 0)
-				return temp;
-			temp = temp->next;
-		}
-		return NULL;
-	}
+	file_data_free(((cache_ht_entry *)entry)->fileData);
+	free(entry);
 }
 
-void lru_list_insert_at_first(lru_list *list, struct file_data *file_data)
-{
-	lru_node *newNode = Malloc(sizeof(struct lru_node));
-	newNode->fileName = strdup(file_data->file_name);
-	if (list->head == NULL)
-	{ // empty list
-		list->head = newNode;
-		list->tail = newNode;
-		newNode->next = NULL;
-		newNode->prev = NULL;
-		list->listSize++;
-		return;
-	}
-	else
-	{ // non-empty list
-		newNode->next = list->head;
-		newNode->prev = NULL;
-		list->head->prev = newNode;
-		list->head = newNode;
-		list->listSize++;
-		return;
-	}
-}
+/* --------------------------------------------------------------------------------------- */
 
-int lru_list_remove_first(lru_list *list)
+/* --------------------------------------------------------------------------------------- */
+
+/* find a file in this thread's l1 cache. this doesn't touch any shared state, except for
+ * the access bit of the entry that is found, and the references to entries that have been
+ * evicted from the server cache, which are dropped so that they don't keep the evicted
+ * files in memory until the same file is looked up again. */
+cache_ht_entry *l1_lookup(char *fileName)
 {
-	if (list == NULL || list->head == NULL)
-	{ // empty list
-		return 0;
-	}
-	if (list->head->next == NULL)
-	{ // one node in list
-		free(list->head->fileName);
-		free(list->head);
-		list->head = NULL;
-		list->tail = NULL;
-		list->listSize--;
-		return 1;
+	cache_ht_entry *found = NULL;
+	int hash = djb2(fileName);
+	if (++L1.lookups % L1_AGE_INTERVAL == 0)
+	{ // age the hit counts, so that entries that are no longer hot can be replaced
+		for (int i = 0; i < L1_CACHE_SIZE; i++)
+			L1.slot[i].hits /= 2;
 	}
-	else
-	{ // more than one node in list
-		lru_node *toDelete = list->head;
-		list->head = list->head->next;
-		list->head->prev = NULL;
-		free(toDelete->fileName);
-		free(toDelete);
-		list->listSize--;
-		return 1;
+	for (int i = 0; i < L1_CACHE_SIZE; i++)
+	{
+		l1_slot *slot = &L1.slot[i];
+		if (slot->entry == NULL)
+			continue;
+		if (__atomic_load_n(&slot->entry->evicted, __ATOMIC_ACQUIRE) ||
+			__atomic_load_n(&slot->entry->retired, __ATOMIC_ACQUIRE))
+		{ // stale
+			cache_entry_put(slot->entry);
+			slot->entry = NULL;
+			slot->hits = 0;
+			continue;
+		}
+		if (found == NULL && slot->hash == hash && strcmp(slot->entry->fileData->file_name, fileName) == 0)
+		{
+			slot->hits++;
+			found = slot->entry;
+		}
 	}
+	// a hit, like those in the server cache, gives the entry a second chance
+	if (found != NULL && !__atomic_load_n(&found->accessed, __ATOMIC_RELAXED))
+		__atomic_store_n(&found->accessed, 1, __ATOMIC_RELAXED);
+	return found;
 }
 
-int lru_list_remove_last(lru_list *list)
+/* add an entry that was found in the server cache to this thread's l1 cache, replacing
+ * the entry with the fewest hits. the caller must hold a reference to the entry. */
+void l1_insert(cache_ht_entry *entry)
 {
-	if (list == NULL || list->tail == NULL)
-	{ // empty list
-		return 0;
-	}
-	if (list->tail->prev == NULL)
-	{ // one node in list
-		free(list->tail->fileName);
-		free(list->tail);
-		list->head = NULL;
-		list->tail = NULL;
-		list->listSize--;
-		return 1;
-	}
-	else
+	l1_slot *victim = &L1.slot[0];
+	for (int i = 0; i < L1_CACHE_SIZE; i++)
 	{
-		lru_node *toDelete = list->tail;
-		list->tail = list->tail->prev;
-		list->tail->next = NULL;
-		list->listSize--;
-		free(toDelete->fileName);
-		free(toDelete);
-		return 1;
+		if (L1.slot[i].entry == entry)
+			return;
+		if (L1.slot[i].entry == NULL || L1.slot[i].hits < victim->hits)
+			victim = &L1.slot[i];
+		if (victim->entry == NULL)
+			break;
 	}
+	if (victim->entry != NULL)
+		cache_entry_put(victim->entry);
+	__atomic_add_fetch(&entry->inUse, 1, __ATOMIC_SEQ_CST);
+	victim->entry = entry;
+	victim->hash = djb2(entry->fileData->file_name);
+	victim->hits = 1;
 }
 
-int lru_list_remove_one(lru_list *list, struct file_data *file_data)
+/* drop all references held by this thread's l1 cache */
+void l1_release(void)
 {
-	if (list == NULL || list->head == NULL)
-		return 0;
-	if (strcmp(list->head->fileName, file_data->file_name) == 0) // head
-		return lru_list_remove_first(list);
-	if (strcmp(list->tail->fileName, file_data->file_name) == 0) // tail
-		return lru_list_remove_last(list);
-	else
+	for (int i = 0; i < L1_CACHE_SIZE; i++)
 	{
-		lru_node *toDelete = lru_list_search(list, file_data);
-		toDelete->next->prev = toDelete->prev;
-		toDelete->prev->next = toDelete->next;
-		list->listSize--;
-		free(toDelete->fileName);
-		free(toDelete);
-		return 1;
+		if (L1.slot[i].entry != NULL)
+			cache_entry_put(L1.slot[i].entry);
+		L1.slot[i].entry = NULL;
+		L1.slot[i].hits = 0;
 	}
 }
-
-int lru_list_move_to_head(lru_list *list, struct file_data *file_data)
-{
-	lru_node *temp = lru_list_search(list, file_data);
-	if (temp == NULL)
-		return 0;
-	int ret = lru_list_remove_one(list, file_data);
-	if (ret == 0)
-		return 0;
-	lru_list_insert_at_first(list, file_data);
-	return 1;
-}
\ No newline at end of file
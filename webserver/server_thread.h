@@ -2,10 +2,55 @@
 #define __SERVER_THREAD_H__
 
 struct server;
+struct shm_cache;
+struct storage;
 
+/* optional server settings, beyond the ones passed to server_init() */
+struct server_opts {
+	struct shm_cache *shm_cache; /* cache shared with other worker
+				      * processes, used instead of a
+				      * per-process cache when not NULL */
+	int max_fds;		     /* files kept open between requests,
+				      * 0 to open them for every request */
+	struct storage *storage;     /* where files are read from, a
+				      * simulated slow disk if NULL */
+	int prefetch_bw;	     /* bytes per second read ahead of
+				      * requests, 0 to disable prefetching */
+	const char *access_log;	     /* requests are logged to this file,
+				      * and to a binary trace next to it,
+				      * when not NULL (see access_log.h) */
+	/* deadlines for slow clients, in ms, or 0 for none (see
+	 * request_set_timeouts()) */
+	int idle_timeout;
+	int header_timeout;
+	int write_timeout;
+	const char *doc_index;	     /* only the files in this directory or
+				      * fileset manifest are served, when not
+				      * NULL (see doc_index.h) */
+	const char *archive;	     /* all files are served from this archive,
+				      * without a cache, when not NULL (see
+				      * archive.h) */
+	int watchdog_ms;	     /* requests a worker thread has been on
+				      * for longer than this are reported, 0
+				      * for no watchdog (see watchdog.h) */
+	int watchdog_close;	     /* and their connections shut down */
+};
+
+void server_opts_init(struct server_opts *opts);
 struct server *server_init(int nr_threads, int max_requests, 
 			   int max_cache_size);
+struct server *server_init_opts(int nr_threads, int max_requests,
+				int max_cache_size,
+				const struct server_opts *opts);
 void server_request(struct server *sv, int connfd);
+/* prints the latency percentiles of the requests served so far, merged across
+ * the worker threads, and the time spent in each stage of them (see
+ * stage_timer.h), to stderr */
+void server_report(struct server *sv);
+/* rebuilds the document root index, to pick up changed files, on a thread of
+ * its own. requests keep being served from the old index until the new one is
+ * in place */
+void server_reload(struct server *sv);
 void server_exit(struct server *sv);
 
 #endif /* __SERVER_THREAD_H__ */
@@ -0,0 +1,570 @@
+/*
+ * shm_cache.c: A file cache in shared memory, for the prefork server mode.
+ *
+ * The region starts with a header holding the lock, the hash table and the
+ * lru list, followed by a heap from which the cache entries are allocated.
+ * Links are offsets from the start of the region, and 0 is used as NULL
+ * because the header always lives at offset 0.
+ *
+ * Every reference handed out by shm_cache_get() is a pin in a table in the
+ * header, recording the entry and the pid of the worker that holds it. When
+ * a worker dies holding the lock, the hash table, the lru list and the free
+ * list can't be trusted, but the pins can, as a pin is only written once the
+ * entry it points to is complete. The recovery drops the pins of dead
+ * workers, and rebuilds the heap around the entries that live workers still
+ * have pinned, which are left out of the new cache as orphans, and freed when
+ * their last pin is put. The generation of the cache is bumped, so that an
+ * entry of an older generation is known to be an orphan.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "shm_cache.h"
+
+#define SHM_TABLE_SIZE 3571
+#define SHM_MAGIC 0x53484d43
+#define SHM_ALIGN 16
+#define SHM_MAX_PINS 4096	/* requests sending from the cache at once */
+
+#define SHM_PTR(cache, off) ((void *)((cache)->base + (off)))
+#define SHM_OFF(cache, ptr) ((size_t)((char *)(ptr) - (cache)->base))
+#define SHM_ROUND(n) (((n) + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1))
+
+/* every allocation in the heap starts with a chunk header. free chunks are
+ * kept in a list sorted by offset, so that neighbours can be merged. */
+struct shm_chunk {
+	size_t size;	/* chunk size, including this header */
+	size_t next;	/* next free chunk, only used while the chunk is free */
+};
+
+struct shm_entry {
+	size_t hnext;		/* next entry in the hash chain */
+	size_t lru_prev;	/* towards the most recently used entry */
+	size_t lru_next;	/* towards the least recently used entry */
+	size_t body;		/* offset of the file contents */
+	size_t result;		/* offset of the processing result, which
+				 * follows the contents, 0 if there is none */
+	int size;		/* bytes counted in cur_size */
+	int refs;		/* number of requests sending this entry */
+	unsigned long generation; /* of the cache it was inserted into */
+	int file_size;
+	unsigned int file_csum;
+	time_t file_mtime;
+	char name[];		/* file name, followed by the contents */
+};
+
+/* a reference to an entry, held by a request of worker pid, free if pid is 0 */
+struct shm_pin {
+	pid_t pid;
+	size_t entry;
+};
+
+struct shm_header {
+	unsigned int magic;
+	unsigned long generation; /* bumped by every recovery */
+	pthread_mutex_t lock;	/* process-shared, robust */
+	size_t heap_start;
+	size_t heap_end;
+	size_t free_list;
+	int max_size;		/* max bytes of file contents and results */
+	int cur_size;
+	int nr_entries;
+	unsigned long evictions;
+	size_t lru_head;
+	size_t lru_tail;
+	size_t table[SHM_TABLE_SIZE];
+	int pin_hint;		/* where to look for a free pin */
+	struct shm_pin pins[SHM_MAX_PINS];
+};
+
+/* per-process handle to the shared region */
+struct shm_cache {
+	char *base;
+	size_t size;
+	struct shm_header *hdr;
+};
+
+static unsigned int
+shm_hash(char *key)
+{
+	unsigned int hash = 5381;
+
+	while (*key)
+		hash = hash * 33 + (unsigned char)*key++;
+	return hash % SHM_TABLE_SIZE;
+}
+
+static int
+shm_offset_cmp(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* appends the free chunk [start, end) to the free list, whose last chunk is
+ * at *tail */
+static void
+shm_reset_free(struct shm_cache *cache, size_t start, size_t end,
+	       size_t *tail)
+{
+	struct shm_chunk *chunk;
+
+	if (end <= start)
+		return;
+	chunk = SHM_PTR(cache, start);
+	chunk->size = end - start;
+	chunk->next = 0;
+	if (*tail != 0)
+		((struct shm_chunk *)SHM_PTR(cache, *tail))->next = start;
+	else
+		cache->hdr->free_list = start;
+	*tail = start;
+}
+
+/* empties the cache, except for the entries that are still pinned, which
+ * stay where they are, as orphans, and makes the rest of the heap free */
+static void
+shm_reset(struct shm_cache *cache)
+{
+	struct shm_header *hdr = cache->hdr;
+	struct shm_pin *pin;
+	struct shm_entry *entry;
+	struct shm_chunk *chunk;
+	size_t *pinned, off, tail = 0, end = hdr->heap_start;
+	int i, nr_pinned = 0;
+
+	hdr->generation++;
+	memset(hdr->table, 0, sizeof(hdr->table));
+	hdr->lru_head = hdr->lru_tail = 0;
+	hdr->cur_size = 0;
+	hdr->nr_entries = 0;
+	pinned = Malloc(sizeof(size_t) * SHM_MAX_PINS);
+	for (i = 0; i < SHM_MAX_PINS; i++) {
+		pin = &hdr->pins[i];
+		if (pin->pid == 0)
+			continue;
+		chunk = SHM_PTR(cache, pin->entry - sizeof(struct shm_chunk));
+		if (pin->entry < hdr->heap_start + sizeof(struct shm_chunk) ||
+		    pin->entry >= hdr->heap_end ||
+		    chunk->size > hdr->heap_end - pin->entry) {
+			pin->pid = 0;	/* can't be trusted */
+			continue;
+		}
+		entry = SHM_PTR(cache, pin->entry);
+		/* counted again below, once per pin */
+		entry->refs = 0;
+		pinned[nr_pinned++] = pin->entry - sizeof(struct shm_chunk);
+	}
+	for (i = 0; i < SHM_MAX_PINS; i++) {
+		pin = &hdr->pins[i];
+		if (pin->pid != 0)
+			((struct shm_entry *)SHM_PTR(cache, pin->entry))->refs++;
+	}
+	qsort(pinned, nr_pinned, sizeof(size_t), shm_offset_cmp);
+	hdr->free_list = 0;
+	for (i = 0; i < nr_pinned; i++) {
+		off = pinned[i];
+		if (off < end)
+			continue;	/* pinned more than once */
+		shm_reset_free(cache, end, off, &tail);
+		chunk = SHM_PTR(cache, off);
+		end = off + chunk->size;
+		entry = SHM_PTR(cache, off + sizeof(struct shm_chunk));
+		hdr->cur_size += entry->size;
+	}
+	shm_reset_free(cache, end, hdr->heap_end, &tail);
+	free(pinned);
+}
+
+/* drops the pins of workers that are gone */
+static void
+shm_release_dead(struct shm_cache *cache)
+{
+	struct shm_pin *pin;
+	int i;
+
+	for (i = 0; i < SHM_MAX_PINS; i++) {
+		pin = &cache->hdr->pins[i];
+		if (pin->pid != 0 && kill(pin->pid, 0) < 0 && errno == ESRCH)
+			pin->pid = 0;
+	}
+}
+
+/* a worker that died while holding the lock may have left the cache
+ * inconsistent, so we start over with an empty cache, keeping only what
+ * other workers are still sending from */
+static void
+shm_lock(struct shm_cache *cache)
+{
+	int ret = pthread_mutex_lock(&cache->hdr->lock);
+
+	if (ret == EOWNERDEAD) {
+		fprintf(stderr, "shm_cache: worker died holding the cache lock, "
+			"resetting cache\n");
+		shm_release_dead(cache);
+		shm_reset(cache);
+		pthread_mutex_consistent(&cache->hdr->lock);
+	} else if (ret != 0) {
+		errno = ret;
+		unix_error("shm_lock");
+	}
+}
+
+static void
+shm_unlock(struct shm_cache *cache)
+{
+	pthread_mutex_unlock(&cache->hdr->lock);
+}
+
+/* first fit allocation, returns the offset of the usable memory or 0 */
+static size_t
+shm_alloc(struct shm_cache *cache, size_t size)
+{
+	struct shm_header *hdr = cache->hdr;
+	size_t off, *prevp;
+	struct shm_chunk *chunk, *rest;
+
+	size = SHM_ROUND(size + sizeof(struct shm_chunk));
+	for (prevp = &hdr->free_list; (off = *prevp) != 0;
+	     prevp = &chunk->next) {
+		chunk = SHM_PTR(cache, off);
+		if (chunk->size < size)
+			continue;
+		if (chunk->size - size >= 2 * sizeof(struct shm_chunk)) {
+			/* split, leaving the tail of the chunk free */
+			rest = SHM_PTR(cache, off + size);
+			rest->size = chunk->size - size;
+			rest->next = chunk->next;
+			chunk->size = size;
+			*prevp = off + size;
+		} else {
+			*prevp = chunk->next;
+		}
+		return off + sizeof(struct shm_chunk);
+	}
+	return 0;
+}
+
+static void
+shm_free(struct shm_cache *cache, size_t ptr)
+{
+	struct shm_header *hdr = cache->hdr;
+	size_t off = ptr - sizeof(struct shm_chunk);
+	size_t prev = 0, next;
+	struct shm_chunk *chunk = SHM_PTR(cache, off), *p, *n;
+
+	/* find the free neighbours around this chunk */
+	for (next = hdr->free_list; next != 0 && next < off; next = p->next) {
+		p = SHM_PTR(cache, next);
+		prev = next;
+	}
+	chunk->next = next;
+	if (next != 0 && off + chunk->size == next) {
+		n = SHM_PTR(cache, next);
+		chunk->size += n->size;
+		chunk->next = n->next;
+	}
+	if (prev == 0) {
+		hdr->free_list = off;
+		return;
+	}
+	p = SHM_PTR(cache, prev);
+	if (prev + p->size == off) {
+		p->size += chunk->size;
+		p->next = chunk->next;
+	} else {
+		p->next = off;
+	}
+}
+
+static void
+shm_lru_unlink(struct shm_cache *cache, struct shm_entry *entry)
+{
+	struct shm_header *hdr = cache->hdr;
+
+	if (entry->lru_prev)
+		((struct shm_entry *)SHM_PTR(cache, entry->lru_prev))->lru_next =
+			entry->lru_next;
+	else
+		hdr->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		((struct shm_entry *)SHM_PTR(cache, entry->lru_next))->lru_prev =
+			entry->lru_prev;
+	else
+		hdr->lru_tail = entry->lru_prev;
+}
+
+static void
+shm_lru_push(struct shm_cache *cache, struct shm_entry *entry)
+{
+	struct shm_header *hdr = cache->hdr;
+	size_t off = SHM_OFF(cache, entry);
+
+	entry->lru_prev = 0;
+	entry->lru_next = hdr->lru_head;
+	if (hdr->lru_head)
+		((struct shm_entry *)SHM_PTR(cache, hdr->lru_head))->lru_prev =
+			off;
+	else
+		hdr->lru_tail = off;
+	hdr->lru_head = off;
+}
+
+static struct shm_entry *
+shm_search(struct shm_cache *cache, char *name)
+{
+	size_t off = cache->hdr->table[shm_hash(name)];
+	struct shm_entry *entry;
+
+	while (off != 0) {
+		entry = SHM_PTR(cache, off);
+		if (strcmp(entry->name, name) == 0)
+			return entry;
+		off = entry->hnext;
+	}
+	return NULL;
+}
+
+/* evicts the least recently used entry that is not being sent.
+ * returns 0 if there is no such entry. */
+static int
+shm_evict_one(struct shm_cache *cache)
+{
+	struct shm_header *hdr = cache->hdr;
+	struct shm_entry *entry = NULL, *e;
+	size_t off, *prevp;
+
+	for (off = hdr->lru_tail; off != 0; off = entry->lru_prev) {
+		entry = SHM_PTR(cache, off);
+		if (entry->refs == 0)
+			break;
+	}
+	if (off == 0)
+		return 0;
+	for (prevp = &hdr->table[shm_hash(entry->name)]; *prevp != off;
+	     prevp = &e->hnext) {
+		e = SHM_PTR(cache, *prevp);
+	}
+	*prevp = entry->hnext;
+	shm_lru_unlink(cache, entry);
+	hdr->cur_size -= entry->size;
+	hdr->nr_entries--;
+	hdr->evictions++;
+	shm_free(cache, off);
+	return 1;
+}
+
+struct shm_cache *
+shm_cache_create(int max_size)
+{
+	struct shm_cache *cache;
+	struct shm_header *hdr;
+	pthread_mutexattr_t attr;
+	char name[64];
+	int fd;
+
+	cache = Malloc(sizeof(struct shm_cache));
+	/* leave room for the entry headers and names next to the contents */
+	cache->size = SHM_ROUND(sizeof(struct shm_header)) +
+		SHM_ROUND((size_t)max_size + max_size / 4 + (1 << 20));
+	snprintf(name, sizeof(name), "/os-webserver-cache-%d", getpid());
+	SYS(fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600));
+	/* the mapping is inherited by the forked workers, so the name is not
+	 * needed after this, and unlinking it avoids leaking the region */
+	SYS(shm_unlink(name));
+	SYS(ftruncate(fd, cache->size));
+	cache->base = mmap(NULL, cache->size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+	if (cache->base == MAP_FAILED)
+		unix_error("shm_cache_create: mmap");
+	SYS(close(fd));
+
+	hdr = cache->hdr = (struct shm_header *)cache->base;
+	hdr->magic = SHM_MAGIC;
+	hdr->max_size = max_size;
+	hdr->heap_start = SHM_ROUND(sizeof(struct shm_header));
+	hdr->heap_end = cache->size;
+	hdr->generation = 1;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&hdr->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	shm_reset(cache);
+	return cache;
+}
+
+void
+shm_cache_destroy(struct shm_cache *cache)
+{
+	if (cache == NULL)
+		return;
+	SYS(munmap(cache->base, cache->size));
+	free(cache);
+}
+
+/* returns a free pin, or NULL if all are taken */
+static struct shm_pin *
+shm_pin_alloc(struct shm_cache *cache)
+{
+	struct shm_header *hdr = cache->hdr;
+	int i, n;
+
+	for (n = 0; n < SHM_MAX_PINS; n++) {
+		i = (hdr->pin_hint + n) % SHM_MAX_PINS;
+		if (hdr->pins[i].pid == 0) {
+			hdr->pin_hint = (i + 1) % SHM_MAX_PINS;
+			return &hdr->pins[i];
+		}
+	}
+	return NULL;
+}
+
+/* drops a pin, and frees its entry if that was the last pin of an orphan */
+static void
+shm_pin_put(struct shm_cache *cache, struct shm_pin *pin)
+{
+	struct shm_header *hdr = cache->hdr;
+	struct shm_entry *entry = SHM_PTR(cache, pin->entry);
+
+	pin->pid = 0;
+	if (--entry->refs > 0 || entry->generation == hdr->generation)
+		return;
+	/* an orphan of an older cache, which only its pins kept alive */
+	hdr->cur_size -= entry->size;
+	shm_free(cache, pin->entry);
+}
+
+size_t
+shm_cache_get(struct shm_cache *cache, struct file_data *data)
+{
+	struct shm_entry *entry;
+	struct shm_pin *pin;
+	pid_t pid = getpid();
+	size_t ref = 0;
+
+	assert(cache->hdr->magic == SHM_MAGIC);
+	shm_lock(cache);
+	entry = shm_search(cache, data->file_name);
+	/* with every pin taken, the request is served as a miss */
+	if (entry != NULL && (pin = shm_pin_alloc(cache)) != NULL) {
+		assert(entry->generation == cache->hdr->generation);
+		pin->entry = SHM_OFF(cache, entry);
+		pin->pid = pid;
+		entry->refs++;
+		shm_lru_unlink(cache, entry);
+		shm_lru_push(cache, entry);
+		data->file_size = entry->file_size;
+		data->file_csum = entry->file_csum;
+		data->file_mtime = entry->file_mtime;
+		data->file_buf = SHM_PTR(cache, entry->body);
+		data->file_result = entry->result != 0 ?
+			SHM_PTR(cache, entry->result) : &request_processed;
+		ref = pin - cache->hdr->pins + 1;
+	}
+	shm_unlock(cache);
+	return ref;
+}
+
+void
+shm_cache_put(struct shm_cache *cache, size_t ref)
+{
+	struct shm_pin *pin = &cache->hdr->pins[ref - 1];
+
+	shm_lock(cache);
+	/* the pin survives a recovery, unless this worker was taken for dead */
+	if (pin->pid == getpid())
+		shm_pin_put(cache, pin);
+	shm_unlock(cache);
+}
+
+void
+shm_cache_release(struct shm_cache *cache, pid_t pid)
+{
+	int i;
+
+	shm_lock(cache);
+	for (i = 0; i < SHM_MAX_PINS; i++) {
+		if (cache->hdr->pins[i].pid == pid)
+			shm_pin_put(cache, &cache->hdr->pins[i]);
+	}
+	shm_unlock(cache);
+}
+
+int
+shm_cache_insert(struct shm_cache *cache, struct file_data *data)
+{
+	struct shm_header *hdr = cache->hdr;
+	struct file_result *result = data->file_result;
+	struct shm_entry *entry;
+	size_t name_len, result_len = 0, off;
+	unsigned int index;
+	int size = data->file_size;
+
+	/* a hit is sent as it is, so only processed files are cached */
+	if (result == NULL)
+		return 0;
+	if (result != &request_processed) {
+		result_len = sizeof(struct file_result) + result->size;
+		size += result->size;
+	}
+	if (size > hdr->max_size)
+		return 0;
+	name_len = strlen(data->file_name) + 1;
+	shm_lock(cache);
+	if (shm_search(cache, data->file_name) != NULL) {
+		shm_unlock(cache);
+		return 0;
+	}
+	while (hdr->cur_size + size > hdr->max_size) {
+		if (!shm_evict_one(cache))
+			goto full;
+	}
+	/* the heap can be fragmented even when there is room */
+	while ((off = shm_alloc(cache, sizeof(struct shm_entry) + name_len +
+				data->file_size + (result_len > 0 ?
+				SHM_ALIGN + result_len : 0))) == 0) {
+		if (!shm_evict_one(cache))
+			goto full;
+	}
+	entry = SHM_PTR(cache, off);
+	entry->refs = 0;
+	entry->generation = hdr->generation;
+	entry->size = size;
+	entry->file_size = data->file_size;
+	entry->file_csum = data->file_csum;
+	entry->file_mtime = data->file_mtime;
+	memcpy(entry->name, data->file_name, name_len);
+	entry->body = off + sizeof(struct shm_entry) + name_len;
+	if (data->file_size > 0)
+		memcpy(SHM_PTR(cache, entry->body), data->file_buf,
+		       data->file_size);
+	entry->result = 0;
+	if (result_len > 0) {
+		entry->result = SHM_ROUND(entry->body + data->file_size);
+		memcpy(SHM_PTR(cache, entry->result), result, result_len);
+	}
+	index = shm_hash(entry->name);
+	entry->hnext = hdr->table[index];
+	hdr->table[index] = off;
+	shm_lru_push(cache, entry);
+	hdr->cur_size += size;
+	hdr->nr_entries++;
+	shm_unlock(cache);
+	return 1;
+full:
+	shm_unlock(cache);
+	return 0;
+}
+
+void
+shm_cache_get_stats(struct shm_cache *cache, struct shm_cache_stats *stats)
+{
+	shm_lock(cache);
+	stats->size = cache->hdr->cur_size;
+	stats->max_size = cache->hdr->max_size;
+	stats->entries = cache->hdr->nr_entries;
+	stats->evictions = cache->hdr->evictions;
+	shm_unlock(cache);
+}
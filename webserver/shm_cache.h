@@ -0,0 +1,51 @@
+#ifndef __SHM_CACHE_H__
+#define __SHM_CACHE_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct file_data;
+
+/* A file cache that lives in one shared memory region, so that it can be
+ * shared by the worker processes of a prefork server. The region is created
+ * before the workers are forked, and it is mapped at the same place in every
+ * worker, but all links inside it are stored as offsets from the start of the
+ * region, so that it does not depend on where it is mapped.
+ *
+ * The cache is protected by a process-shared robust mutex. If a worker dies
+ * while holding it, the next worker to take the lock resets the cache, but
+ * the entries that other workers are sending from stay in place until they
+ * are done with them. */
+struct shm_cache;
+
+struct shm_cache *shm_cache_create(int max_size);
+void shm_cache_destroy(struct shm_cache *cache);
+
+/* looks up file data->file_name. on a hit, fills data->file_size, file_csum,
+ * file_mtime and points data->file_buf and data->file_result into the shared
+ * region, and returns a reference that pins the entry until it is passed to
+ * shm_cache_put(). the caller must not free data->file_buf or
+ * data->file_result. returns 0 on a miss. */
+size_t shm_cache_get(struct shm_cache *cache, struct file_data *data);
+void shm_cache_put(struct shm_cache *cache, size_t ref);
+/* drops the references held by worker pid, which has died, e.g., while it
+ * was sending from the cache */
+void shm_cache_release(struct shm_cache *cache, pid_t pid);
+
+/* copies data, and its processing result next to its contents, into the
+ * cache, evicting least recently used entries as needed. files that have not
+ * been processed are not cached. returns 1 if the file was cached, 0
+ * otherwise. */
+int shm_cache_insert(struct shm_cache *cache, struct file_data *data);
+
+/* the state of the cache, which all the worker processes share */
+struct shm_cache_stats {
+	int size;		/* bytes of file contents and results */
+	int max_size;
+	int entries;
+	unsigned long evictions;
+};
+
+void shm_cache_get_stats(struct shm_cache *cache, struct shm_cache_stats *stats);
+
+#endif /* __SHM_CACHE_H__ */
@@ -0,0 +1,151 @@
+/*
+ * stage_timer.c: Calibration and reporting of the stage timers.
+ *
+ * Every thread that times a stage gets counters of its own, which stay on a
+ * list until stage_exit(), so that the counters of threads that have exited
+ * are still reported.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stage_timer.h"
+
+double stage_ns_per_tick = 1.0;
+
+static pthread_once_t stage_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t stage_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stage_counters *stage_list;
+
+static const char *stage_names[STAGE_NR] = {
+	[STAGE_QUEUE] = "queue",
+	[STAGE_PARSE] = "parse",
+	[STAGE_LOOKUP] = "lookup",
+	[STAGE_READ] = "read",
+	[STAGE_CSUM] = "csum",
+	[STAGE_PROCESS] = "process",
+	[STAGE_WRITE] = "write",
+};
+
+static uint64_t
+stage_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+stage_do_calibrate(void)
+{
+#ifdef STAGE_TSC
+	struct timespec pause = { 0, 10000000 };
+	uint64_t ns, ticks;
+
+	ns = stage_monotonic();
+	ticks = stage_clock();
+	nanosleep(&pause, NULL);
+	ns = stage_monotonic() - ns;
+	ticks = stage_clock() - ticks;
+	if (ticks > 0)
+		stage_ns_per_tick = (double)ns / ticks;
+#endif
+}
+
+void
+stage_calibrate(void)
+{
+	pthread_once(&stage_once, stage_do_calibrate);
+}
+
+#if STAGE_TIMERS
+__thread struct stage_counters *stage_self;
+
+struct stage_counters *
+stage_register(void)
+{
+	struct stage_counters *c;
+
+	if ((c = calloc(1, sizeof(struct stage_counters))) == NULL) {
+		perror("stage_register");
+		exit(1);
+	}
+	pthread_mutex_lock(&stage_lock);
+	c->next = stage_list;
+	stage_list = c;
+	pthread_mutex_unlock(&stage_lock);
+	stage_self = c;
+	return c;
+}
+#endif /* STAGE_TIMERS */
+
+const char *
+stage_name(int stage)
+{
+	return stage_names[stage];
+}
+
+void
+stage_get_totals(uint64_t ns[STAGE_NR], uint64_t count[STAGE_NR])
+{
+	struct stage_counters *c;
+	uint64_t ticks[STAGE_NR];
+	int i;
+
+	memset(ticks, 0, sizeof(ticks));
+	memset(count, 0, sizeof(uint64_t) * STAGE_NR);
+	pthread_mutex_lock(&stage_lock);
+	for (c = stage_list; c != NULL; c = c->next) {
+		for (i = 0; i < STAGE_NR; i++) {
+			ticks[i] += __atomic_load_n(&c->ticks[i],
+						    __ATOMIC_RELAXED);
+			count[i] += __atomic_load_n(&c->count[i],
+						    __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&stage_lock);
+	for (i = 0; i < STAGE_NR; i++)
+		ns[i] = stage_ns(ticks[i]);
+}
+
+void
+stage_report(FILE *f)
+{
+	uint64_t ns[STAGE_NR], count[STAGE_NR];
+	double total = 0, ms;
+	int i;
+
+	stage_get_totals(ns, count);
+	for (i = 0; i < STAGE_NR; i++)
+		total += ns[i];
+	if (total == 0)
+		return;
+	fprintf(f, "%-8s %10s %12s %10s %6s\n", "stage", "count", "total ms",
+		"mean us", "share");
+	for (i = 0; i < STAGE_NR; i++) {
+		ms = ns[i] / 1e6;
+		fprintf(f, "%-8s %10lu %12.2f %10.2f %5.1f%%\n", stage_names[i],
+			(unsigned long)count[i], ms,
+			count[i] ? ms * 1000 / count[i] : 0.0,
+			ms * 1e6 / total * 100);
+	}
+}
+
+void
+stage_exit(void)
+{
+	struct stage_counters *c, *next;
+
+	pthread_mutex_lock(&stage_lock);
+	for (c = stage_list; c != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
+	stage_list = NULL;
+	pthread_mutex_unlock(&stage_lock);
+#if STAGE_TIMERS
+	stage_self = NULL;
+#endif
+}
@@ -0,0 +1,113 @@
+#ifndef __STAGE_TIMER_H__
+#define __STAGE_TIMER_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define STAGE_TSC
+#else
+#include <time.h>
+#endif
+
+/* Cheap timers for the stages of a request. Time is measured in ticks of the
+ * cpu's time stamp counter, which takes a few ns to read, and is converted to
+ * ns only when it is reported, at a rate measured once by stage_calibrate().
+ * Without a time stamp counter, a tick is a ns of CLOCK_MONOTONIC.
+ *
+ * The ticks spent in each stage are added up in counters of the thread, so no
+ * locks or shared cache lines are touched, and stage_report() adds up the
+ * counters of all the threads. Build with -DSTAGE_TIMERS=0 to compile the
+ * counters out, leaving only stage_clock() and stage_ns(). */
+#ifndef STAGE_TIMERS
+#define STAGE_TIMERS 1
+#endif
+
+enum {
+	STAGE_QUEUE,		/* waiting for a worker thread */
+	STAGE_PARSE,		/* reading and parsing the request */
+	STAGE_LOOKUP,		/* looking up the file in the cache */
+	STAGE_READ,		/* reading the file from storage */
+	STAGE_CSUM,		/* checksumming the file */
+	STAGE_PROCESS,		/* request_processfile() */
+	STAGE_WRITE,		/* writing the response to the socket */
+	STAGE_NR
+};
+
+struct stage_counters {
+	uint64_t ticks[STAGE_NR];
+	uint64_t count[STAGE_NR];
+	struct stage_counters *next;
+};
+
+static inline uint64_t
+stage_clock(void)
+{
+#ifdef STAGE_TSC
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* measures the rate of the time stamp counter, once, before stage_ns() is
+ * used. takes about 10 ms the first time */
+void stage_calibrate(void);
+extern double stage_ns_per_tick;
+
+static inline uint64_t
+stage_ns(uint64_t ticks)
+{
+	return ticks * stage_ns_per_tick;
+}
+
+#if STAGE_TIMERS
+extern __thread struct stage_counters *stage_self;
+struct stage_counters *stage_register(void);
+
+/* adds ticks to a stage of this thread */
+static inline void
+stage_add(int stage, uint64_t ticks)
+{
+	struct stage_counters *c = stage_self ? stage_self : stage_register();
+
+	/* only this thread writes its counters, the stores are atomic so that
+	 * stage_report() doesn't see torn values */
+	__atomic_store_n(&c->ticks[stage], c->ticks[stage] + ticks,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&c->count[stage], c->count[stage] + 1,
+			 __ATOMIC_RELAXED);
+}
+
+/* times a stage that nothing else needs the time of */
+static inline uint64_t
+stage_begin(void)
+{
+	return stage_clock();
+}
+
+static inline void
+stage_end(int stage, uint64_t start)
+{
+	stage_add(stage, stage_clock() - start);
+}
+#else
+static inline void stage_add(int stage, uint64_t ticks) {}
+static inline uint64_t stage_begin(void) { return 0; }
+static inline void stage_end(int stage, uint64_t start) {}
+#endif /* STAGE_TIMERS */
+
+/* adds up the time in ns, and the count, of each stage over all threads,
+ * while they keep counting. all zero if the counters are compiled out */
+void stage_get_totals(uint64_t ns[STAGE_NR], uint64_t count[STAGE_NR]);
+const char *stage_name(int stage);
+/* prints a table of the count, total and mean time of each stage, and its
+ * share of the total. prints nothing if the counters are compiled out. */
+void stage_report(FILE *f);
+/* frees the counters, once no thread will time a stage again */
+void stage_exit(void);
+
+#endif /* __STAGE_TIMER_H__ */
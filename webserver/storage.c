@@ -0,0 +1,315 @@
+/*
+ * storage.c: Storage backends, including a simulated device.
+ *
+ * The simulated device keeps a virtual schedule instead of making reads
+ * wait for each other: a read computes when it would finish, given when the
+ * device slots and the transfer bus become free, reserves that time under
+ * the lock, and then sleeps without holding anything. A process that dies
+ * while sleeping therefore leaves the device in a consistent state.
+ */
+
+#define _GNU_SOURCE	/* O_DIRECT */
+#include <time.h>
+#include "common.h"
+#include "storage.h"
+
+#define STORAGE_MAX_SLOTS 256
+#define STORAGE_DIRECT_ALIGN 4096
+
+#define STORAGE_ROUND_DOWN(n) ((n) & ~(off_t)(STORAGE_DIRECT_ALIGN - 1))
+#define STORAGE_ROUND_UP(n) STORAGE_ROUND_DOWN((n) + STORAGE_DIRECT_ALIGN - 1)
+
+/* state of a simulated device, shared by all processes */
+struct storage_device {
+	pthread_mutex_t lock;	/* process-shared */
+	long long latency;	/* ns per read */
+	long long bw;		/* bytes per second, 0 for unlimited */
+	int conc;		/* device slots, 0 for unlimited */
+	int qd;			/* outstanding reads, 0 for unlimited */
+	long long bus_free;	/* when the transfer bus becomes free */
+	long long slot_free[STORAGE_MAX_SLOTS]; /* when each slot becomes free */
+	long long queue_free[STORAGE_MAX_SLOTS]; /* when each read that is
+						  * outstanding is done */
+};
+
+struct storage {
+	const char *name;
+	ssize_t (*read)(struct storage *st, int fd, void *buf, size_t n,
+			off_t offset);
+	struct storage_device *dev;	/* for simulated devices */
+	int failed;			/* a read failed, and was reported */
+};
+
+/* parameters of the simulated devices */
+struct storage_preset {
+	const char *name;
+	int latency;		/* us */
+	int bw;			/* MB/s */
+	int conc;
+	int qd;
+};
+
+static const struct storage_preset storage_presets[] = {
+	{ "sim", 10000, 0, 0, 0 },
+	{ "ssd", 100, 500, 8, 32 },
+	{ "hdd", 8000, 150, 1, 32 },
+	{ NULL, 0, 0, 0, 0 },
+};
+
+static long long
+storage_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* reads n bytes at offset, or up to the end of the file */
+static ssize_t
+storage_pread(int fd, void *buf, size_t n, off_t offset)
+{
+	size_t nleft = n;
+	ssize_t nread;
+	char *bufp = buf;
+
+	while (nleft > 0) {
+		if ((nread = pread(fd, bufp, nleft, offset)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		} else if (nread == 0) {
+			break;	/* EOF */
+		}
+		nleft -= nread;
+		bufp += nread;
+		offset += nread;
+	}
+	return n - nleft;
+}
+
+static ssize_t
+storage_fs_read(struct storage *st, int fd, void *buf, size_t n, off_t offset)
+{
+	ssize_t ret = storage_pread(fd, buf, n, offset);
+
+	/* ask the kernel to stop caching the file */
+	if (ret > 0)
+		posix_fadvise(fd, offset, ret, POSIX_FADV_DONTNEED);
+	return ret;
+}
+
+/* O_DIRECT needs aligned offsets, lengths and buffers, so whole aligned
+ * blocks are read into a bounce buffer */
+static ssize_t
+storage_direct_read(struct storage *st, int fd, void *buf, size_t n,
+		    off_t offset)
+{
+	off_t start = STORAGE_ROUND_DOWN(offset);
+	size_t len = STORAGE_ROUND_UP(offset + (off_t)n) - start;
+	char path[32];
+	ssize_t ret;
+	void *bounce;
+	int dfd;
+
+	/* fd is shared with other requests and the fd cache, so the file is
+	 * opened again, rather than setting O_DIRECT on fd */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	if ((dfd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC)) < 0) {
+		/* e.g., EINVAL from file systems without O_DIRECT */
+		if (!__atomic_exchange_n(&st->failed, 1, __ATOMIC_RELAXED))
+			fprintf(stderr, "storage: direct open: %s\n",
+				strerror(errno));
+		return -1;
+	}
+	if (posix_memalign(&bounce, STORAGE_DIRECT_ALIGN, len) != 0) {
+		close(dfd);
+		errno = ENOMEM;
+		return -1;
+	}
+	ret = storage_pread(dfd, bounce, len, start);
+	if (ret >= 0) {
+		ret -= offset - start;
+		if (ret < 0)
+			ret = 0;
+		if ((size_t)ret > n)
+			ret = n;
+		memcpy(buf, (char *)bounce + (offset - start), ret);
+	}
+	free(bounce);
+	close(dfd);
+	return ret;
+}
+
+/* returns the one of the first n times that is the earliest */
+static int
+storage_earliest(const long long *times, int n)
+{
+	int i, earliest = 0;
+
+	for (i = 1; i < n; i++) {
+		if (times[i] < times[earliest])
+			earliest = i;
+	}
+	return earliest;
+}
+
+static ssize_t
+storage_sim_read(struct storage *st, int fd, void *buf, size_t n,
+		 off_t offset)
+{
+	struct storage_device *dev = st->dev;
+	long long now, start, end;
+	struct timespec ts;
+	ssize_t ret;
+	int slot = 0, queued = 0;
+
+	/* the device is the only cost: the file comes from the page cache */
+	ret = storage_pread(fd, buf, n, offset);
+	if (ret < 0)
+		return ret;
+
+	now = storage_now();
+	pthread_mutex_lock(&dev->lock);
+	start = now;
+	if (dev->qd > 0) {
+		/* admitted when an outstanding read is done */
+		queued = storage_earliest(dev->queue_free, dev->qd);
+		if (dev->queue_free[queued] > start)
+			start = dev->queue_free[queued];
+	}
+	if (dev->conc > 0) {
+		slot = storage_earliest(dev->slot_free, dev->conc);
+		if (dev->slot_free[slot] > start)
+			start = dev->slot_free[slot];
+	}
+	end = start + dev->latency;
+	if (dev->bw > 0) {
+		if (dev->bus_free > end)
+			end = dev->bus_free;
+		end += (long long)ret * 1000000000LL / dev->bw;
+		dev->bus_free = end;
+	}
+	if (dev->conc > 0)
+		dev->slot_free[slot] = end;
+	if (dev->qd > 0)
+		dev->queue_free[queued] = end;
+	pthread_mutex_unlock(&dev->lock);
+
+	ts.tv_sec = end / 1000000000LL;
+	ts.tv_nsec = end % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+	return ret;
+}
+
+/* parses "key=value,..." into the device parameters */
+static int
+storage_parse_params(const char *params, struct storage_preset *p)
+{
+	char key[16];
+	int value, len;
+
+	while (*params) {
+		if (sscanf(params, "%15[a-z]=%d%n", key, &value, &len) != 2 ||
+		    value < 0)
+			return -1;
+		if (strcmp(key, "latency") == 0)
+			p->latency = value;
+		else if (strcmp(key, "bw") == 0)
+			p->bw = value;
+		else if (strcmp(key, "conc") == 0)
+			p->conc = value;
+		else if (strcmp(key, "qd") == 0)
+			p->qd = value;
+		else
+			return -1;
+		params += len;
+		if (*params == ',')
+			params++;
+		else if (*params != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static struct storage_device *
+storage_device_create(const struct storage_preset *p)
+{
+	struct storage_device *dev;
+	pthread_mutexattr_t attr;
+
+	/* shared, so that forked worker processes use the same device */
+	dev = mmap(NULL, sizeof(struct storage_device), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (dev == MAP_FAILED)
+		unix_error("storage_device_create: mmap");
+	memset(dev, 0, sizeof(struct storage_device));
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&dev->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	dev->latency = p->latency * 1000LL;
+	dev->bw = p->bw * 1000000LL;
+	dev->conc = p->conc < STORAGE_MAX_SLOTS ? p->conc : STORAGE_MAX_SLOTS;
+	dev->qd = p->qd < STORAGE_MAX_SLOTS ? p->qd : STORAGE_MAX_SLOTS;
+	return dev;
+}
+
+struct storage *
+storage_create(const char *spec)
+{
+	const struct storage_preset *preset;
+	struct storage_preset params;
+	struct storage *st;
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? colon - spec : strlen(spec);
+
+	st = Malloc(sizeof(struct storage));
+	st->dev = NULL;
+	st->failed = 0;
+	if (colon == NULL && strcmp(spec, "fs") == 0) {
+		st->name = "fs";
+		st->read = storage_fs_read;
+		return st;
+	}
+	if (colon == NULL && strcmp(spec, "direct") == 0) {
+		st->name = "direct";
+		st->read = storage_direct_read;
+		return st;
+	}
+	for (preset = storage_presets; preset->name != NULL; preset++) {
+		if (strlen(preset->name) == len &&
+		    strncmp(spec, preset->name, len) == 0)
+			break;
+	}
+	params = *preset;
+	if (preset->name == NULL ||
+	    (colon != NULL && storage_parse_params(colon + 1, &params) < 0)) {
+		free(st);
+		return NULL;
+	}
+	st->name = preset->name;
+	st->read = storage_sim_read;
+	st->dev = storage_device_create(&params);
+	return st;
+}
+
+void
+storage_destroy(struct storage *st)
+{
+	if (st == NULL)
+		return;
+	if (st->dev != NULL)
+		SYS(munmap(st->dev, sizeof(struct storage_device)));
+	free(st);
+}
+
+ssize_t
+storage_read(struct storage *st, int fd, void *buf, size_t n, off_t offset)
+{
+	if (st == NULL)
+		return storage_fs_read(NULL, fd, buf, n, offset);
+	return st->read(st, fd, buf, n, offset);
+}
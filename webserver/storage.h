@@ -0,0 +1,43 @@
+#ifndef __STORAGE_H__
+#define __STORAGE_H__
+
+#include <sys/types.h>
+
+/* The storage backend that files are read from, on a cache miss. The backend
+ * is chosen by a description string:
+ *
+ *   fs		read through the file system, and drop the pages from the page
+ *		cache afterwards, so that the next read goes to the disk again
+ *   direct	read with O_DIRECT, bypassing the page cache. reads fail on
+ *		file systems that don't support it
+ *   sim	read through the page cache, and then wait as long as a
+ *		simulated device would take for the read
+ *   ssd, hdd	sim, with the parameters of a typical device
+ *
+ * The simulated devices take parameters, as in "hdd:qd=4,bw=100":
+ *
+ *   latency	time per read, in microseconds
+ *   bw		transfer rate, in MB/s, shared by all reads. 0 for unlimited
+ *   conc	reads the device serves at once. 0 for unlimited
+ *   qd		reads the host keeps outstanding at the device. 0 for unlimited
+ *
+ * A read first waits in the host until fewer than qd reads are outstanding,
+ * then at the device until one of its conc slots is free, then for its
+ * latency, and then for its turn to transfer its bytes at the device's rate.
+ * It stays outstanding, and keeps its slot, until it is done. The default,
+ * "sim", waits 10 ms per read, like the original server did.
+ *
+ * The state of a simulated device lives in shared memory, so a backend
+ * created before forking models one device shared by all the processes. */
+struct storage;
+
+struct storage *storage_create(const char *spec); /* NULL if spec is invalid */
+void storage_destroy(struct storage *st);
+
+/* reads up to n bytes at offset of file fd into buf. returns the number of
+ * bytes read, which is less than n only at the end of the file, or -1 with
+ * errno set on error. a NULL st reads through the file system. */
+ssize_t storage_read(struct storage *st, int fd, void *buf, size_t n,
+		     off_t offset);
+
+#endif /* __STORAGE_H__ */
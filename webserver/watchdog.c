@@ -0,0 +1,188 @@
+/*
+ * watchdog.c: Finds worker threads that are stuck on a request.
+ *
+ * The slots stay on the list of the watchdog until it is destroyed, so that
+ * it never looks at a slot that is being freed. A slot is only written by its
+ * thread. The watchdog takes the lock of a slot to read it, and to shut its
+ * connection down, so that the thread can't close the connection, and the fd
+ * be reused for another one, in between.
+ */
+
+#include <sys/syscall.h>
+#include <time.h>
+#include "common.h"
+#include "stage_timer.h"
+#include "watchdog.h"
+
+__thread struct watchdog_slot *watchdog_self;
+
+struct watchdog {
+	pthread_mutex_t lock;	/* protects the list and stuck */
+	pthread_cond_t wake;
+	pthread_t thread;
+	int exiting;
+	uint64_t threshold_ns;
+	int close_stuck;
+	unsigned long stuck;
+	struct watchdog_slot *slots;
+};
+
+static void
+watchdog_register(struct watchdog *w)
+{
+	struct watchdog_slot *s = Malloc(sizeof(struct watchdog_slot));
+
+	memset(s, 0, sizeof(struct watchdog_slot));
+	pthread_mutex_init(&s->lock, NULL);
+	s->fd = -1;
+	s->tid = syscall(SYS_gettid);
+	pthread_mutex_lock(&w->lock);
+	s->next = w->slots;
+	w->slots = s;
+	pthread_mutex_unlock(&w->lock);
+	watchdog_self = s;
+}
+
+void
+watchdog_begin(struct watchdog *w, int fd, uint64_t started)
+{
+	struct watchdog_slot *s;
+
+	if (w == NULL)
+		return;
+	if (watchdog_self == NULL)
+		watchdog_register(w);
+	s = watchdog_self;
+	pthread_mutex_lock(&s->lock);
+	s->fd = fd;
+	s->started = started;
+	s->seq++;
+	s->file[0] = '\0';
+	__atomic_store_n(&s->stage, STAGE_PARSE, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void
+watchdog_file(const char *file)
+{
+	struct watchdog_slot *s = watchdog_self;
+
+	if (s == NULL)
+		return;
+	pthread_mutex_lock(&s->lock);
+	strncpy(s->file, file, sizeof(s->file) - 1);
+	s->file[sizeof(s->file) - 1] = '\0';
+	pthread_mutex_unlock(&s->lock);
+}
+
+void
+watchdog_end(void)
+{
+	struct watchdog_slot *s = watchdog_self;
+
+	if (s == NULL)
+		return;
+	pthread_mutex_lock(&s->lock);
+	s->fd = -1;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* reports the request of slot s if it is stuck. called with w->lock held */
+static void
+watchdog_check(struct watchdog *w, struct watchdog_slot *s, uint64_t now)
+{
+	uint64_t ns;
+
+	pthread_mutex_lock(&s->lock);
+	/* the thread may have taken its request after now was read */
+	if (s->fd < 0 || s->reported == s->seq || now < s->started)
+		goto out;
+	ns = stage_ns(now - s->started);
+	if (ns < w->threshold_ns)
+		goto out;
+	s->reported = s->seq;
+	w->stuck++;
+	fprintf(stderr, "watchdog: thread %d stuck for %lu ms in %s, fd %d, "
+		"file %s%s\n", (int)s->tid, (unsigned long)(ns / 1000000),
+		stage_name(__atomic_load_n(&s->stage, __ATOMIC_RELAXED)),
+		s->fd, s->file[0] ? s->file : "-",
+		w->close_stuck ? ", shutting the connection down" : "");
+	if (w->close_stuck)
+		shutdown(s->fd, SHUT_RDWR);
+out:
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void *
+watchdog_thread(void *arg)
+{
+	struct watchdog *w = arg;
+	struct watchdog_slot *s;
+	struct timespec deadline;
+	uint64_t interval = w->threshold_ns / 4, now;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->exiting) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += (deadline.tv_nsec + interval) / 1000000000;
+		deadline.tv_nsec = (deadline.tv_nsec + interval) % 1000000000;
+		pthread_cond_timedwait(&w->wake, &w->lock, &deadline);
+		now = stage_clock();
+		for (s = w->slots; s != NULL && !w->exiting; s = s->next)
+			watchdog_check(w, s, now);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+struct watchdog *
+watchdog_create(int threshold_ms, int close_stuck)
+{
+	struct watchdog *w = Malloc(sizeof(struct watchdog));
+
+	memset(w, 0, sizeof(struct watchdog));
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->wake, NULL);
+	w->threshold_ns = (uint64_t)threshold_ms * 1000000;
+	w->close_stuck = close_stuck;
+	stage_calibrate();
+	if ((errno = pthread_create(&w->thread, NULL, watchdog_thread, w)))
+		unix_error("watchdog_create: pthread_create");
+	return w;
+}
+
+void
+watchdog_destroy(struct watchdog *w)
+{
+	struct watchdog_slot *s, *next;
+
+	if (w == NULL)
+		return;
+	pthread_mutex_lock(&w->lock);
+	w->exiting = 1;
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	for (s = w->slots; s != NULL; s = next) {
+		next = s->next;
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+	}
+	/* the slots of the other threads went with them */
+	watchdog_self = NULL;
+	pthread_cond_destroy(&w->wake);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
+
+unsigned long
+watchdog_get_stuck(struct watchdog *w)
+{
+	unsigned long stuck;
+
+	pthread_mutex_lock(&w->lock);
+	stuck = w->stuck;
+	pthread_mutex_unlock(&w->lock);
+	return stuck;
+}
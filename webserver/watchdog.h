@@ -0,0 +1,60 @@
+#ifndef __WATCHDOG_H__
+#define __WATCHDOG_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A watchdog for worker threads that get stuck on a request, e.g., blocked
+ * on a client that neither sends nor takes anything while its deadlines are
+ * off (see request_set_timeouts()).
+ *
+ * Every worker thread publishes what it is doing in a slot of its own: the
+ * connection and file of its request, when it took it, and the stage of it
+ * (see stage_timer.h) it is in. A background thread looks at the slots four
+ * times per threshold, and prints those that have been on the same request
+ * for longer than that to stderr, once per request. With close_stuck, it also
+ * shuts the connection down, which makes a blocked read or write fail, so
+ * that the thread gets on with the next request. */
+struct watchdog;
+
+struct watchdog_slot {
+	pthread_mutex_t lock;	/* protects fd and file from the watchdog */
+	int fd;			/* connection of the request, -1 if none */
+	int stage;		/* STAGE_*, stored without the lock */
+	uint64_t started;	/* stage_clock() time the request was taken */
+	unsigned long seq;	/* requests the thread has taken */
+	unsigned long reported;	/* seq of the last request reported stuck */
+	pid_t tid;		/* as in ps -L, top -H or gdb */
+	char file[64];		/* truncated */
+	struct watchdog_slot *next;
+};
+
+/* the slot of this thread, once it has taken a request with a watchdog */
+extern __thread struct watchdog_slot *watchdog_self;
+
+struct watchdog *watchdog_create(int threshold_ms, int close_stuck);
+/* stops the background thread. the threads with slots must be done with
+ * their requests */
+void watchdog_destroy(struct watchdog *w);
+/* the thread takes the request on fd, at stage_clock() time started. does
+ * nothing if w is NULL */
+void watchdog_begin(struct watchdog *w, int fd, uint64_t started);
+/* the request turned out to be for file */
+void watchdog_file(const char *file);
+/* the thread is done with the request, and is about to close its connection,
+ * which the watchdog won't touch after this */
+void watchdog_end(void);
+/* the number of requests found stuck so far */
+unsigned long watchdog_get_stuck(struct watchdog *w);
+
+/* the thread's request moves on to stage */
+static inline void
+watchdog_stage(int stage)
+{
+	if (watchdog_self != NULL)
+		__atomic_store_n(&watchdog_self->stage, stage,
+				 __ATOMIC_RELAXED);
+}
+
+#endif /* __WATCHDOG_H__ */